@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Microbenchmarks for the hot paths. This file is included at the end of
+ * early-service.c when it's built as early-service-benchmark, so that it can
+ * call the static functions directly, and it has its own main() in place of
+ * the service's. Configure with -Dbenchmarks=true and run `meson benchmark`,
+ * which writes the results to benchmark.json in the build directory, to diff
+ * them between commits.
+ *
+ * Each benchmark runs for at least --min_time_ms and reports the time and the
+ * number of heap allocations per operation. Allocations are counted by
+ * replacing malloc(), so the ones that glib makes are counted too. Nothing
+ * goes over a socket: commands are parsed and answered into the output queue
+ * of a connection, which is then reset, and log messages are formatted but
+ * thrown away.
+ */
+
+#ifdef HAVE_LIBC_MALLOC
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static guint64 benchmark_allocs;
+
+void *malloc(size_t size)
+{
+	__atomic_fetch_add(&benchmark_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&benchmark_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&benchmark_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#endif
+
+static gint benchmark_min_time_ms = 200;
+static gchar *benchmark_json_path;
+static gchar *benchmark_filter;
+
+static GOptionEntry benchmark_entries[] = {
+	{ "min_time_ms", 0, 0, G_OPTION_ARG_INT, &benchmark_min_time_ms,
+	  "Run each benchmark for at least this long", NULL },
+	{ "json", 0, 0, G_OPTION_ARG_FILENAME, &benchmark_json_path,
+	  "Write the results as JSON to this file ('-' for stdout)", NULL },
+	{ "filter", 0, 0, G_OPTION_ARG_STRING, &benchmark_filter,
+	  "Only run the benchmarks with this in their name", NULL },
+	{ NULL }
+};
+
+struct benchmark {
+	const char *name;
+	void (*run)(const void *data);
+	const void *data;
+};
+
+struct benchmark_result {
+	const char *name;
+	guint64 iterations;
+	double ns_per_op;
+	/* Negative when allocations can't be counted */
+	double allocs_per_op;
+};
+
+static struct counter_data benchmark_cntr;
+static struct connection_info *benchmark_conn;
+
+static GLogWriterOutput benchmark_log_writer(GLogLevelFlags log_level,
+					     const GLogField *fields,
+					     gsize n_fields,
+					     gpointer user_data)
+{
+	return G_LOG_WRITER_HANDLED;
+}
+
+/* What server_process_input() does for each command, up to sending */
+static void benchmark_command(const void *data)
+{
+	char command[sizeof(benchmark_conn->in_buf)];
+	gsize reply_len = benchmark_conn->reply->len;
+
+	g_strlcpy(command, data, sizeof(command));
+	benchmark_conn->command = "unknown";
+	server_dispatch_command(benchmark_conn, command);
+	server_queue_segment(benchmark_conn, NULL, reply_len,
+			     benchmark_conn->reply->len - reply_len);
+	server_reset_output(benchmark_conn);
+}
+
+static void benchmark_reply_cached(const void *data)
+{
+	benchmark_conn->command = "get_counter";
+	server_command_get_counter(benchmark_conn);
+	server_reset_output(benchmark_conn);
+}
+
+/* The counter moves on every time, so the reply is rendered every time */
+static void benchmark_reply_uncached(const void *data)
+{
+	g_atomic_int_inc(&benchmark_cntr.counter);
+	benchmark_conn->command = "get_counter";
+	server_command_get_counter(benchmark_conn);
+	server_reset_output(benchmark_conn);
+}
+
+/* The handoff reply, with a full history */
+static void benchmark_reply_state(const void *data)
+{
+	format_state(&benchmark_cntr, benchmark_conn->reply);
+	server_reset_output(benchmark_conn);
+}
+
+static void benchmark_timer_callback(const void *data)
+{
+	timer_callback(&benchmark_cntr);
+}
+
+static void benchmark_timer_callback_log_every_tick(const void *data)
+{
+	gint burst = log_burst;
+
+	log_burst = 0;
+	timer_callback(&benchmark_cntr);
+	log_burst = burst;
+}
+
+static void benchmark_connection_get_put(const void *data)
+{
+	connection_pool_put(connection_pool_get());
+}
+
+static const struct benchmark benchmarks[] = {
+	{ "command/get_counter", benchmark_command, "get_counter" },
+	{ "command/set_counter", benchmark_command, "set_counter 42" },
+	{ "command/add_counter", benchmark_command, "add_counter 1" },
+	{ "command/cas_counter", benchmark_command, "cas_counter 0 1" },
+	{ "command/batch", benchmark_command, "batch get; add 1; cas 1 2; set 0" },
+	{ "command/unknown", benchmark_command, "no_such_command" },
+	{ "reply/get_counter_cached", benchmark_reply_cached, NULL },
+	{ "reply/get_counter_uncached", benchmark_reply_uncached, NULL },
+	{ "reply/state", benchmark_reply_state, NULL },
+	{ "timer_callback", benchmark_timer_callback, NULL },
+	{ "timer_callback/log_every_tick",
+	  benchmark_timer_callback_log_every_tick, NULL },
+	{ "connection/get_put", benchmark_connection_get_put, NULL },
+};
+
+/* Doubles the number of iterations until a run takes long enough */
+static void benchmark_run(const struct benchmark *benchmark,
+			  struct benchmark_result *result)
+{
+	guint64 iterations = 1;
+	gint64 start_us, elapsed_us;
+#ifdef HAVE_LIBC_MALLOC
+	guint64 allocs = 0;
+#endif
+
+	for (;;) {
+#ifdef HAVE_LIBC_MALLOC
+		allocs = benchmark_allocs;
+#endif
+		start_us = g_get_monotonic_time();
+		for (guint64 i = 0; i < iterations; i++)
+			benchmark->run(benchmark->data);
+		elapsed_us = g_get_monotonic_time() - start_us;
+#ifdef HAVE_LIBC_MALLOC
+		allocs = benchmark_allocs - allocs;
+#endif
+
+		if (elapsed_us >= benchmark_min_time_ms * (gint64) 1000)
+			break;
+		iterations *= 2;
+	}
+
+	result->name = benchmark->name;
+	result->iterations = iterations;
+	result->ns_per_op = elapsed_us * 1000.0 / iterations;
+#ifdef HAVE_LIBC_MALLOC
+	result->allocs_per_op = (double) allocs / iterations;
+#else
+	result->allocs_per_op = -1;
+#endif
+}
+
+static gboolean benchmark_write_json(const char *path,
+				     struct benchmark_result *results,
+				     guint n_results)
+{
+	char number[G_ASCII_DTOSTR_BUF_SIZE];
+	GString *json = g_string_new("{\n  \"benchmarks\": [\n");
+	GError *error = NULL;
+	gboolean ret = TRUE;
+
+	for (guint i = 0; i < n_results; i++) {
+		g_string_append_printf(json, "    {\"name\": \"%s\", \"iterations\": %"
+				       G_GUINT64_FORMAT ", \"ns_per_op\": %s",
+				       results[i].name, results[i].iterations,
+				       g_ascii_formatd(number, sizeof(number),
+						       "%.2f", results[i].ns_per_op));
+		if (results[i].allocs_per_op < 0)
+			g_string_append(json, ", \"allocs_per_op\": null}");
+		else
+			g_string_append_printf(json, ", \"allocs_per_op\": %s}",
+					       g_ascii_formatd(number, sizeof(number),
+							       "%.3f",
+							       results[i].allocs_per_op));
+		g_string_append(json, i + 1 < n_results ? ",\n" : "\n");
+	}
+	g_string_append(json, "  ]\n}\n");
+
+	if (g_str_equal(path, "-")) {
+		fputs(json->str, stdout);
+	} else if (!g_file_set_contents(path, json->str, json->len, &error)) {
+		g_printerr("Error writing %s: %s\n", path, error->message);
+		g_error_free(error);
+		ret = FALSE;
+	}
+
+	g_string_free(json, TRUE);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct benchmark_result results[G_N_ELEMENTS(benchmarks)];
+	GOptionContext *context;
+	GError *error = NULL;
+	guint n_results = 0;
+
+	context = g_option_context_new("- Early Service microbenchmarks");
+	g_option_context_add_main_entries(context, benchmark_entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		g_printerr("option parsing failed: %s\n", error->message);
+		return 1;
+	}
+
+	g_log_set_writer_func(benchmark_log_writer, NULL, NULL);
+
+	history_init(&benchmark_cntr.history, MAX(history_size, 0));
+	for (gint i = 0; i < history_size; i++)
+		history_add(&benchmark_cntr.history, i * 100000, i);
+
+	/* Like under systemd, where the state is stored on every change */
+	state_store_size = STATE_STORE_SIZE;
+	state_store = g_malloc0(state_store_size);
+	create_state_store();
+
+	if (!connection_pool_init())
+		return 1;
+	benchmark_conn = connection_pool_get();
+	benchmark_conn->cntr = &benchmark_cntr;
+
+	for (guint i = 0; i < G_N_ELEMENTS(benchmarks); i++) {
+		struct benchmark_result *result = &results[n_results];
+
+		if (benchmark_filter != NULL &&
+		    strstr(benchmarks[i].name, benchmark_filter) == NULL)
+			continue;
+
+		benchmark_run(&benchmarks[i], result);
+		n_results++;
+
+		if (result->allocs_per_op < 0)
+			g_print("%-32s %12" G_GUINT64_FORMAT " ops %10.1f ns/op\n",
+				result->name, result->iterations,
+				result->ns_per_op);
+		else
+			g_print("%-32s %12" G_GUINT64_FORMAT " ops %10.1f ns/op %8.3f allocs/op\n",
+				result->name, result->iterations,
+				result->ns_per_op, result->allocs_per_op);
+	}
+
+	if (benchmark_json_path != NULL &&
+	    !benchmark_write_json(benchmark_json_path, results, n_results))
+		return 1;
+
+	g_option_context_free(context);
+	return 0;
+}
@@ -14,7 +14,12 @@ install() {
 		grep '^early-service:' "$dracutsysrootdir/etc/group" >> "$initdir/etc/group"
 
 		inst_simple "${systemdsystemunitdir}/early-service-initrd.service" "${systemdsystemunitdir}/early-service-initrd.service"
-		inst_binary /usr/bin/early-service /usr/bin/early-service
+		# Prefer the stripped variant of the binary when it's installed
+		if [ -x "$dracutsysrootdir/usr/libexec/early-service/early-service-initrd" ] ; then
+			inst_binary /usr/libexec/early-service/early-service-initrd /usr/bin/early-service
+		else
+			inst_binary /usr/bin/early-service /usr/bin/early-service
+		fi
 
 		$SYSTEMCTL -q --root "$initdir" enable early-service-initrd.service
 	fi
@@ -1,183 +1,3685 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#define _GNU_SOURCE
+
 #include <gio/gio.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The benchmark and the tests are built from this file too, with their own
+ * main(), so the code that only the service's main() uses is left out of them.
+ */
+#if !defined(EARLY_SERVICE_BENCHMARK) && !defined(EARLY_SERVICE_STATE_LAYOUT_TEST)
+#define EARLY_SERVICE_MAIN
+#endif
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+static gint history_size = 1024;
+static gint idle_timeout_ms = 5000;
+static gint read_timeout_ms = 0;
+static gint write_timeout_ms = 0;
+static gint migration_rounds = 0;
+static gchar **client_socket_paths;
+static gchar *state_file_path;
+static GMainLoop *loop;
+static gboolean handed_off = FALSE;
+static gboolean use_seqpacket = FALSE;
+static gboolean tickless = FALSE;
+static gboolean virtual_clock = FALSE;
+static gint log_burst = 20;
+
+#if defined(EARLY_SERVICE_MAIN) || defined(EARLY_SERVICE_BENCHMARK)
+static gint connection_pool_size = 64;
+#endif
 
+#ifdef EARLY_SERVICE_MAIN
 static gint timer_delay_ms = 100;
+static gint listen_backlog = 64;
+static gint max_connections = 0;
+static gint max_connections_per_uid = 0;
 static gchar *server_socket_path;
-static gchar *client_socket_path;
-static GMainLoop *loop;
+static gchar *syslog_identifier = "early-service";
 static gboolean survive_systemd_kill_signal = FALSE;
+static gboolean startup_trace = FALSE;
+static gboolean log_journal = FALSE;
+static int exit_status = 0;
 
 // Command line arguments
 static GOptionEntry entries[] = {
 	{ "timer_delay_ms", 'd', 0, G_OPTION_ARG_INT, &timer_delay_ms,
 	  "Timer delay in milliseconds", NULL, },
+	{ "tickless", 'T', 0, G_OPTION_ARG_NONE, &tickless,
+	  "Compute the counter from the clock when it's used instead of waking up on every tick",
+	  NULL, },
 	{ "server_socket_path", 's', 0, G_OPTION_ARG_FILENAME,
-	  &server_socket_path, "Server UNIX domain socket path to listen on",
+	  &server_socket_path,
+	  "Server UNIX domain socket path to listen on (starting with @ for the abstract namespace)",
+	  NULL, },
+	{ "client_socket_path", 'c', 0, G_OPTION_ARG_FILENAME_ARRAY,
+	  &client_socket_paths,
+	  "UNIX domain socket path to read current state (can be given multiple times, tried in order)",
+	  NULL, },
+	{ "state_file", 'f', 0, G_OPTION_ARG_FILENAME, &state_file_path,
+	  "File to save the state to on SIGTERM, and to read it from on startup",
+	  NULL, },
+	{ "seqpacket", 'q', 0, G_OPTION_ARG_NONE, &use_seqpacket,
+	  "Use SOCK_SEQPACKET sockets, with one command or reply per packet",
+	  NULL, },
+	{ "connection_pool_size", 'p', 0, G_OPTION_ARG_INT,
+	  &connection_pool_size,
+	  "Maximum number of client connections that are served at once", NULL, },
+	{ "listen_backlog", 'b', 0, G_OPTION_ARG_INT, &listen_backlog,
+	  "Maximum length of the queue of pending connections", NULL, },
+	{ "max_connections", 'm', 0, G_OPTION_ARG_INT, &max_connections,
+	  "Reply busy to connections above this limit (default: unlimited)",
+	  NULL, },
+	{ "max_connections_per_uid", 'u', 0, G_OPTION_ARG_INT,
+	  &max_connections_per_uid,
+	  "Reply busy to connections from a user above this limit (default: unlimited)",
+	  NULL, },
+	{ "idle_timeout_ms", 'I', 0, G_OPTION_ARG_INT, &idle_timeout_ms,
+	  "Close connections that don't send a command for this long (default: 5000, 0 for never)",
 	  NULL, },
-	{ "client_socket_path", 'c', 0, G_OPTION_ARG_FILENAME,
-	  &client_socket_path, "UNIX domain socket path to read current state",
+	{ "read_timeout_ms", 'R', 0, G_OPTION_ARG_INT, &read_timeout_ms,
+	  "Close connections that take longer to send the rest of a command (default: never)",
+	  NULL, },
+	{ "write_timeout_ms", 'W', 0, G_OPTION_ARG_INT, &write_timeout_ms,
+	  "Close connections that take longer to accept the replies (default: never)",
+	  NULL, },
+	{ "migration_rounds", 'M', 0, G_OPTION_ARG_INT, &migration_rounds,
+	  "Copy the state from the predecessor in up to N rounds before stopping it (0 to stop it right away)",
+	  NULL, },
+	{ "history_size", 'H', 0, G_OPTION_ARG_INT, &history_size,
+	  "Number of counter samples to keep for the history command", NULL, },
+	{ "startup_trace", 't', 0, G_OPTION_ARG_NONE, &startup_trace,
+	  "Log the time that each startup step finished at", NULL, },
+	{ "log_journal", 'j', 0, G_OPTION_ARG_NONE, &log_journal,
+	  "Log to the journal even if stderr isn't connected to it", NULL, },
+	{ "syslog_identifier", 'i', 0, G_OPTION_ARG_STRING, &syslog_identifier,
+	  "Identifier for messages that are sent to the journal", NULL, },
+	{ "log_burst", 'l', 0, G_OPTION_ARG_INT, &log_burst,
+	  "Maximum number of messages per second from each busy code path (0 for unlimited)",
+	  NULL, },
+	{ "virtual_clock", 'V', 0, G_OPTION_ARG_NONE, &virtual_clock,
+	  "Run the timers off a clock that only moves with the advance_clock command",
 	  NULL, },
 	{ "survive_systemd_kill_signal", 0, 0, G_OPTION_ARG_NONE,
 	  &survive_systemd_kill_signal,
 	  "Set argv[0][0] to '@' when running in initrd", NULL },
 	{ NULL }
 };
+#endif
+
+struct history_sample {
+	gint64 time_us;
+	gint64 value;
+};
+
+/*
+ * Ring of the counter values at each tick, with the CLOCK_BOOTTIME time they
+ * were taken at. The count samples from start on are ordered by time.
+ */
+struct history {
+	struct history_sample *samples;
+	guint size;
+	guint start;
+	guint count;
+	/* The number of samples that were ever added, which numbers them */
+	guint64 added;
+};
 
 struct counter_data {
 	int counter;
+	/*
+	 * Number of handoffs that lead up to this process. The first instance
+	 * started in the initrd is generation 0, and every successor that
+	 * takes over the state from a predecessor is one higher.
+	 */
+	guint generation;
+	/*
+	 * With --tickless, counter is only the base value. The current value
+	 * is the base plus the number of whole periods since the epoch, a
+	 * CLOCK_BOOTTIME time. Changing the counter only changes the base, so
+	 * the epoch stays the same, and it is passed on in the handoff.
+	 * epoch_us is 0 when the counter is ticking.
+	 */
+	gint64 epoch_us;
+	gint64 period_us;
+	/*
+	 * The CLOCK_BOOTTIME time of the last tick of a ticking counter, 0
+	 * before the first one. It's passed on in the handoff, so that the
+	 * successor keeps ticking in the same phase.
+	 */
+	gint64 last_tick_us;
+	struct history history;
+};
+
+#define CACHE_LINE_SIZE 64
+#define SERVER_MAX_COMMAND_LENGTH 256
+#define SERVER_MAX_OUTPUT_SEGMENTS 16
+#define SERVER_OUTPUT_HIGH_WATER (64 * 1024)
+/* Below the default socket send buffer, which bounds a SOCK_SEQPACKET record */
+#define SERVER_SEQPACKET_MAX_RECORD (64 * 1024)
+
+/*
+ * A timer in the timer wheel. pprev points at the pointer to the timer in its
+ * slot, so that it can be removed without searching, and is NULL when the
+ * timer isn't armed.
+ */
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer **pprev;
+	guint64 expires;
+	void (*callback)(struct wheel_timer *timer);
+};
+
+enum connection_deadline {
+	DEADLINE_IDLE,
+	DEADLINE_READ,
+	DEADLINE_WRITE,
+	N_DEADLINES,
+};
+
+struct output_segment {
+	/* NULL when the segment is in connection_info.reply */
+	const char *data;
+	gsize offset;
+	gsize size;
+	/* Set when data is a cached reply, which is released once sent */
+	struct reply_cache_entry *cache_entry;
 };
 
 struct connection_info {
 	GSocketConnection *connection;
 	struct counter_data *cntr;
-	char buf[50];
+	/* Links the unused entries of the connection pool together */
+	struct connection_info *next_free;
+	uid_t uid;
+	/* Kept across uses of the pool entry, so that they aren't reallocated */
+	GString *reply;
+	GCancellable *cancellable;
 	gboolean terminate_at_end;
+	gboolean close_at_end;
+
+	/* Replies that are waiting to be sent, and whether they're being sent */
+	struct output_segment out_segments[SERVER_MAX_OUTPUT_SEGMENTS];
+	GOutputVector out_vectors[SERVER_MAX_OUTPUT_SEGMENTS];
+	guint n_out_segments;
+	gsize out_bytes;
+	/* With SOCK_SEQPACKET, how much was sent, and is being sent */
+	gsize out_sent;
+	gsize out_sending;
+	guint n_queued_commands;
+	gboolean sending;
+
+	/* The command that is being replied to, for logging */
+	const char *command;
+	gint64 command_start_us;
+
+	/*
+	 * Input that was read from the client. Complete commands are between
+	 * in_start and the last newline before in_end.
+	 */
+	char in_buf[SERVER_MAX_COMMAND_LENGTH];
+	gsize in_start;
+	gsize in_end;
+	gboolean discarding;
+	gboolean eof;
+
+	/* The deadline for the read or write that is in progress */
+	struct wheel_timer deadline;
+	enum connection_deadline deadline_type;
+	gboolean expired;
+
+	/*
+	 * Set while the connection waits for the counter to reach the value
+	 * of an alarm, with the position of the alarm in the heap. Once it
+	 * fires, the connection is queued to carry on from an idle callback,
+	 * and the counter is kept until the reply can be queued.
+	 */
+	gboolean alarm_pending;
+	guint alarm_index;
+	gboolean alarm_fired;
+	gboolean alarm_queued;
+	int alarm_counter;
+	struct connection_info *next_fired;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#ifdef EARLY_SERVICE_MAIN
+/*
+ * Logging goes straight to the native journald socket when stderr is
+ * connected to the journal, or when --log_journal is given, so that journald
+ * doesn't need to parse the text and the messages can carry fields such as
+ * COUNTER= and COMMAND=. Otherwise the messages are written to stderr.
+ */
+
+static gboolean use_journal = FALSE;
+
+static GLogWriterOutput log_writer(GLogLevelFlags log_level,
+				   const GLogField *fields, gsize n_fields,
+				   gpointer user_data)
+{
+	if (g_log_writer_default_would_drop(log_level, NULL))
+		return G_LOG_WRITER_HANDLED;
+
+	if (use_journal) {
+		/*
+		 * Messages written to the native socket don't get the
+		 * SyslogIdentifier= of the unit, so it's added here.
+		 */
+		GLogField journal_fields[n_fields + 1];
+
+		memcpy(journal_fields, fields, n_fields * sizeof(*fields));
+		journal_fields[n_fields] = (GLogField) {
+			"SYSLOG_IDENTIFIER", syslog_identifier, -1
+		};
+
+		if (g_log_writer_journald(log_level, journal_fields,
+					  n_fields + 1,
+					  user_data) == G_LOG_WRITER_HANDLED)
+			return G_LOG_WRITER_HANDLED;
+	}
+
+	return g_log_writer_standard_streams(log_level, fields, n_fields,
+					     user_data);
+}
+
+static void log_init(void)
+{
+	use_journal = log_journal || g_log_writer_is_journald(fileno(stderr));
+	g_log_set_writer_func(log_writer, NULL, NULL);
+}
+#endif
+
+#define LOG_NO_VALUE G_MININT64
+
+/* Same mapping as g_log_structured() uses */
+static const char *log_level_to_priority(GLogLevelFlags log_level)
+{
+	if (log_level & G_LOG_LEVEL_ERROR)
+		return "3";
+	else if (log_level & (G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING))
+		return "4";
+	else if (log_level & G_LOG_LEVEL_MESSAGE)
+		return "5";
+	else if (log_level & G_LOG_LEVEL_INFO)
+		return "6";
+	else
+		return "7";
+}
+
+/*
+ * Logs a message with the COMMAND=, COUNTER= and LATENCY_US= fields. Pass
+ * NULL or LOG_NO_VALUE to leave a field out.
+ */
+static void G_GNUC_PRINTF(5, 6) log_event(GLogLevelFlags log_level,
+					  const char *command, gint64 counter,
+					  gint64 latency_us,
+					  const char *format, ...)
+{
+	char message[128], counter_buf[24], latency_buf[24];
+	GLogField fields[5];
+	gsize n_fields = 0;
+	va_list args;
+
+	va_start(args, format);
+	g_vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	fields[n_fields++] = (GLogField) { "MESSAGE", message, -1 };
+	fields[n_fields++] = (GLogField) {
+		"PRIORITY", log_level_to_priority(log_level), -1
+	};
+
+	if (command != NULL)
+		fields[n_fields++] = (GLogField) { "COMMAND", command, -1 };
+
+	if (counter != LOG_NO_VALUE) {
+		g_snprintf(counter_buf, sizeof(counter_buf), "%" G_GINT64_FORMAT,
+			   counter);
+		fields[n_fields++] = (GLogField) { "COUNTER", counter_buf, -1 };
+	}
+
+	if (latency_us != LOG_NO_VALUE) {
+		g_snprintf(latency_buf, sizeof(latency_buf), "%" G_GINT64_FORMAT,
+			   latency_us);
+		fields[n_fields++] = (GLogField) { "LATENCY_US", latency_buf, -1 };
+	}
+
+	g_log_structured_array(log_level, fields, n_fields);
+}
+
+/*
+ * Limits how many messages a single call site logs per second, so that a
+ * fast timer or a misbehaving client can't flood the journal. The number of
+ * dropped messages is logged once the interval is over.
+ */
+struct ratelimit {
+	gint64 begin;
+	guint count;
+	guint suppressed;
 };
 
-static gboolean timer_callback(gpointer data)
+static gboolean ratelimit_test(struct ratelimit *rl, const char *where)
 {
-	struct counter_data *cntr = data;
+	gint64 now = g_get_monotonic_time();
+
+	if (log_burst <= 0)
+		return TRUE;
+
+	if (now - rl->begin >= G_USEC_PER_SEC) {
+		if (rl->suppressed > 0)
+			g_message("Suppressed %u messages from %s",
+				  rl->suppressed, where);
+
+		rl->begin = now;
+		rl->count = 0;
+		rl->suppressed = 0;
+	}
+
+	if (rl->count < (guint) log_burst) {
+		rl->count++;
+		return TRUE;
+	}
+
+	rl->suppressed++;
+	return FALSE;
+}
+
+#define log_event_ratelimited(...)					\
+	G_STMT_START {							\
+		static struct ratelimit _rl;				\
+		if (ratelimit_test(&_rl, G_STRFUNC))			\
+			log_event(__VA_ARGS__);				\
+	} G_STMT_END
+
+static gint64 get_boottime_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+
+	return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/*
+ * With --virtual_clock, time only passes when a test driver sends the
+ * advance_clock command. The ticks, the tickless counter, the history, the
+ * alarms and the connection deadlines all run off this clock, so hours of
+ * operation can be simulated in seconds, with the same results every time.
+ * The timeouts are kept in a list that is sorted by the time they're due,
+ * and advancing the clock runs them in order, each at the time it was due.
+ * The virtual time is passed on in the handoff.
+ */
+
+struct virtual_timeout {
+	guint id;
+	gint64 due_us;
+	guint interval_ms;
+	GSourceFunc func;
+	gpointer data;
+};
+
+static gint64 virtual_now_us;
+static GList *virtual_timeouts;
+static guint virtual_timeout_last_id;
+static struct virtual_timeout *virtual_timeout_running;
+/* Set while the timeouts run, with the advances that they asked for */
+static gboolean virtual_clock_advancing;
+static gint64 virtual_clock_queued_us;
+
+static gint64 clock_boottime_us(void)
+{
+	return virtual_clock ? virtual_now_us : get_boottime_us();
+}
+
+static gint64 clock_monotonic_us(void)
+{
+	return virtual_clock ? virtual_now_us : g_get_monotonic_time();
+}
+
+static gint virtual_timeout_compare(gconstpointer a, gconstpointer b)
+{
+	const struct virtual_timeout *ta = a, *tb = b;
+
+	if (ta->due_us != tb->due_us)
+		return ta->due_us < tb->due_us ? -1 : 1;
+
+	/* Timeouts that are due at the same time run in the order they were added */
+	return ta->id < tb->id ? -1 : ta->id > tb->id;
+}
+
+static guint clock_timeout_add(guint interval_ms, GSourceFunc func,
+			       gpointer data)
+{
+	struct virtual_timeout *timeout;
+
+	if (!virtual_clock)
+		return g_timeout_add(interval_ms, func, data);
+
+	timeout = g_new(struct virtual_timeout, 1);
+	timeout->id = ++virtual_timeout_last_id;
+	timeout->due_us = virtual_now_us + (gint64) interval_ms * 1000;
+	timeout->interval_ms = interval_ms;
+	timeout->func = func;
+	timeout->data = data;
+	virtual_timeouts = g_list_insert_sorted(virtual_timeouts, timeout,
+						virtual_timeout_compare);
+
+	return timeout->id;
+}
+
+static void clock_source_remove(guint id)
+{
+	if (!virtual_clock) {
+		g_source_remove(id);
+		return;
+	}
+
+	/* It's not added back once it returns */
+	if (virtual_timeout_running != NULL && virtual_timeout_running->id == id) {
+		virtual_timeout_running->interval_ms = G_MAXUINT;
+		return;
+	}
+
+	for (GList *l = virtual_timeouts; l != NULL; l = l->next) {
+		struct virtual_timeout *timeout = l->data;
+
+		if (timeout->id == id) {
+			virtual_timeouts = g_list_delete_link(virtual_timeouts, l);
+			g_free(timeout);
+			return;
+		}
+	}
+}
+
+/* Never goes past G_MAXINT64, so the clock can't go back */
+static gint64 virtual_clock_add(gint64 now_us, gint64 delta_us)
+{
+	return delta_us > G_MAXINT64 - now_us ? G_MAXINT64 : now_us + delta_us;
+}
+
+/*
+ * The timeouts can end up advancing the clock in turn. Those advances are
+ * queued up, and done once the timeouts that are due have run, so that the
+ * timeouts always run in order and the clock never goes back.
+ */
+static void virtual_clock_advance(gint64 delta_us)
+{
+	struct virtual_timeout *timeout;
+	gint64 target_us;
+	gboolean again;
+
+	if (virtual_clock_advancing) {
+		virtual_clock_queued_us = virtual_clock_add(virtual_clock_queued_us,
+							    delta_us);
+		return;
+	}
+
+	virtual_clock_advancing = TRUE;
+	target_us = virtual_clock_add(virtual_now_us, delta_us);
+
+	for (;;) {
+		while (virtual_timeouts != NULL &&
+		       (timeout = virtual_timeouts->data)->due_us <= target_us) {
+			virtual_timeouts = g_list_delete_link(virtual_timeouts,
+							      virtual_timeouts);
+			virtual_now_us = MAX(virtual_now_us, timeout->due_us);
+
+			virtual_timeout_running = timeout;
+			again = timeout->func(timeout->data) == G_SOURCE_CONTINUE;
+			virtual_timeout_running = NULL;
+
+			/* A timeout that repeats without an interval would never end */
+			if (!again || timeout->interval_ms == 0 ||
+			    timeout->interval_ms == G_MAXUINT) {
+				g_free(timeout);
+				continue;
+			}
+
+			timeout->due_us = virtual_clock_add(timeout->due_us,
+							    (gint64) timeout->interval_ms * 1000);
+			virtual_timeouts = g_list_insert_sorted(virtual_timeouts, timeout,
+								virtual_timeout_compare);
+		}
+
+		virtual_now_us = MAX(virtual_now_us, target_us);
+		if (virtual_clock_queued_us == 0)
+			break;
+
+		target_us = virtual_clock_add(virtual_now_us, virtual_clock_queued_us);
+		virtual_clock_queued_us = 0;
+	}
+
+	virtual_clock_advancing = FALSE;
+}
+
+/* Returns the number of ticks of a tickless counter since its epoch */
+static unsigned int counter_ticks(struct counter_data *cntr)
+{
+	gint64 now_us;
+
+	if (cntr->epoch_us == 0)
+		return 0;
+
+	now_us = clock_boottime_us();
+	if (now_us < cntr->epoch_us)
+		return 0;
+
+	return (now_us - cntr->epoch_us) / cntr->period_us;
+}
+
+static void history_init(struct history *history, guint size)
+{
+	history->samples = size > 0 ? g_new(struct history_sample, size) : NULL;
+	history->size = size;
+	history->start = 0;
+	history->count = 0;
+	history->added = 0;
+}
+
+static struct history_sample *history_at(struct history *history, guint i)
+{
+	guint pos = history->start + i;
+
+	if (pos >= history->size)
+		pos -= history->size;
+
+	return &history->samples[pos];
+}
+
+static void history_add(struct history *history, gint64 time_us, gint64 value)
+{
+	struct history_sample *sample;
+
+	if (history->size == 0)
+		return;
+
+	if (history->count < history->size) {
+		sample = history_at(history, history->count++);
+	} else {
+		/* Overwrite the oldest sample */
+		sample = history_at(history, 0);
+		if (++history->start == history->size)
+			history->start = 0;
+	}
+
+	sample->time_us = time_us;
+	sample->value = value;
+	history->added++;
+}
+
+/* Returns the index of the first sample that was taken at or after time_us */
+static guint history_lower_bound(struct history *history, gint64 time_us)
+{
+	guint low = 0, high = history->count;
+
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
+
+		if (history_at(history, mid)->time_us < time_us)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Lists the samples taken between from_us and to_us, both inclusive, as a
+ * line with the number of samples followed by one "time value" line for each.
+ */
+static void format_history(struct history *history, gint64 from_us,
+			   gint64 to_us, GString *out)
+{
+	guint first = history_lower_bound(history, from_us);
+	guint last = to_us < G_MAXINT64 ? history_lower_bound(history, to_us + 1) :
+					  history->count;
+
+	if (last < first)
+		last = first;
+
+	g_string_append_printf(out, "%u\n", last - first);
+	for (guint i = first; i < last; i++) {
+		struct history_sample *sample = history_at(history, i);
+
+		g_string_append_printf(out, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+				       sample->time_us, sample->value);
+	}
+}
+
+/*
+ * The state is checksummed with CRC32C, which x86 (SSE4.2) and ARMv8 have
+ * instructions for. These take 8 bytes at a time, which is about as fast as
+ * the state can be read from memory. Other CPUs use a table.
+ */
+
+static guint32 crc32c_table[256];
+static guint32 (*crc32c_update)(guint32 crc, const guint8 *data, gsize len);
+
+static guint32 crc32c_update_table(guint32 crc, const guint8 *data, gsize len)
+{
+	for (; len > 0; len--)
+		crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+#define CRC32C_INSTRUCTIONS "SSE4.2"
+
+__attribute__((target("sse4.2")))
+static guint32 crc32c_update_hw(guint32 crc, const guint8 *data, gsize len)
+{
+	guint64 crc64 = crc;
+	guint64 word;
+
+	for (; len >= sizeof(word); len -= sizeof(word), data += sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+
+	crc = crc64;
+	for (; len > 0; len--)
+		crc = _mm_crc32_u8(crc, *data++);
+
+	return crc;
+}
+
+static gboolean crc32c_hw_supported(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+#define CRC32C_INSTRUCTIONS "ARMv8 CRC32"
+
+__attribute__((target("+crc")))
+static guint32 crc32c_update_hw(guint32 crc, const guint8 *data, gsize len)
+{
+	guint64 word;
+
+	for (; len >= sizeof(word); len -= sizeof(word), data += sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+
+	for (; len > 0; len--)
+		crc = __crc32cb(crc, *data++);
+
+	return crc;
+}
+
+static gboolean crc32c_hw_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	for (guint i = 0; i < G_N_ELEMENTS(crc32c_table); i++) {
+		guint32 crc = i;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		crc32c_table[i] = crc;
+	}
+
+#ifdef CRC32C_INSTRUCTIONS
+	if (crc32c_hw_supported()) {
+		g_debug("Using the %s instructions for CRC32C",
+			CRC32C_INSTRUCTIONS);
+		crc32c_update = crc32c_update_hw;
+		return;
+	}
+#endif
+
+	g_message("No CRC32C instructions on this CPU, using a table to checksum the state");
+	crc32c_update = crc32c_update_table;
+}
+
+static guint32 crc32c(const void *data, gsize len)
+{
+	if (crc32c_update == NULL)
+		crc32c_init();
+
+	return ~crc32c_update(~0U, data, len);
+}
+
+/*
+ * The state is passed between generations as text. The first line only
+ * contains the counter so that older clients, which only parse a single
+ * number, still work. Additional "key value" lines follow.
+ *
+ * The layout line carries the counter, the generation and the clock once
+ * more, in the versioned binary layout of the file descriptor store (see
+ * below), base64 encoded. When it's there, those are read from it, and a
+ * state in a version that we can't read is rejected like a corrupted one, so
+ * that the next source is tried. Predecessors from before the layout don't
+ * send it, and successors from before it skip it like any unknown key, and
+ * use the key lines instead.
+ */
+
+#define STATE_LAYOUT_KEY "layout "
+
+static void format_state_layout(struct counter_data *cntr, GString *out);
+static gboolean parse_state_layout(const char *value, struct counter_data *cntr);
+
+/* The alarms that the predecessor passed on, and their connections */
+static GArray *handoff_alarm_values;
+static GArray *handoff_alarm_fds;
+
+/* The pid of the predecessor that handed over its state, 0 if it didn't say */
+static pid_t handoff_pid;
+
+/*
+ * The checksum line covers everything before it, from start on. Lines after
+ * it, such as the end of a migration reply, aren't covered.
+ */
+#define STATE_CHECKSUM_KEY "crc32c "
+#define STATE_CHECKSUM_SIZE 32
+
+/* Whether a state was found, but thrown away because it was corrupted */
+static gboolean state_corrupted;
+
+static void append_state_checksum(GString *out, gsize start)
+{
+	g_string_append_printf(out, STATE_CHECKSUM_KEY "%08x\n",
+			       crc32c(out->str + start, out->len - start));
+}
+
+/*
+ * Only the bare counter that the oldest predecessors send can come without a
+ * checksum. Every state with more lines than that has one, so when it's
+ * missing, the state was cut short.
+ */
+static gboolean verify_state_checksum(const char *buf)
+{
+	const char *line = g_strrstr(buf, "\n" STATE_CHECKSUM_KEY);
+	const char *newline;
+	guint32 expected, crc;
+
+	if (line == NULL) {
+		newline = strchr(buf, '\n');
+		if (newline == NULL || newline[strspn(newline, " \t\r\n")] == '\0') {
+			g_message("The state is a bare counter without a checksum, not verifying it");
+			return TRUE;
+		}
+
+		g_warning("The state is corrupted, it has no checksum");
+		state_corrupted = TRUE;
+		return FALSE;
+	}
+
+	line++;
+	expected = g_ascii_strtoull(line + strlen(STATE_CHECKSUM_KEY), NULL, 16);
+	crc = crc32c(buf, line - buf);
+	if (crc != expected) {
+		g_warning("The state is corrupted, its CRC32C is %08x instead of %08x",
+			  crc, expected);
+		state_corrupted = TRUE;
+		return FALSE;
+	}
 
-	g_message("%d", cntr->counter++);
+	return TRUE;
+}
+
+/* The counter, the generation and the clock of a tickless counter */
+#define STATE_HEADER_SIZE 128
+
+static void format_state_header(struct counter_data *cntr, char *buf,
+				gsize size)
+{
+	int base = g_atomic_int_get(&cntr->counter);
+
+	if (cntr->epoch_us == 0) {
+		g_snprintf(buf, size, "%d\ngeneration %u\n", base,
+			   cntr->generation);
+		return;
+	}
+
+	g_snprintf(buf, size, "%d\ngeneration %u\nepoch %" G_GINT64_FORMAT
+		   "\nperiod %" G_GINT64_FORMAT "\nbase %d\n",
+		   (int) ((unsigned int) base + counter_ticks(cntr)),
+		   cntr->generation, cntr->epoch_us, cntr->period_us, base);
+}
+
+/*
+ * Only the samples from number since on are included, which is used to send
+ * the changes since an earlier copy of the state.
+ */
+static void format_state_since(struct counter_data *cntr, guint64 since,
+			       GString *out)
+{
+	guint64 first = cntr->history.added - cntr->history.count;
+	char header[STATE_HEADER_SIZE];
+
+	format_state_header(cntr, header, sizeof(header));
+	g_string_append(out, header);
+	format_state_layout(cntr, out);
+
+	if (cntr->last_tick_us != 0)
+		g_string_append_printf(out, "last_tick %" G_GINT64_FORMAT "\n",
+				       cntr->last_tick_us);
+
+	if (virtual_clock)
+		g_string_append_printf(out, "virtual_clock %" G_GINT64_FORMAT "\n",
+				       virtual_now_us);
+
+	for (guint i = since > first ? MIN(since - first, cntr->history.count) : 0;
+	     i < cntr->history.count; i++) {
+		struct history_sample *sample = history_at(&cntr->history, i);
+
+		g_string_append_printf(out, "history %" G_GINT64_FORMAT " %"
+				       G_GINT64_FORMAT "\n",
+				       sample->time_us, sample->value);
+	}
+}
+
+static void format_state(struct counter_data *cntr, GString *out)
+{
+	format_state_since(cntr, 0, out);
+}
+
+/*
+ * Taking over the clock of a tickless predecessor, instead of the value that
+ * it sampled, means that no tick is lost or counted twice.
+ */
+static void adopt_state_clock(struct counter_data *cntr, gboolean have_base,
+			      int base, gint64 epoch_us, gint64 period_us)
+{
+	cntr->epoch_us = 0;
+	if (tickless && have_base && epoch_us > 0 && period_us > 0) {
+		cntr->counter = base;
+		cntr->epoch_us = epoch_us;
+		cntr->period_us = period_us;
+	}
+}
+
+/* A delta adds its samples to the history instead of replacing it */
+static gboolean parse_state_lines(const char *buf, struct counter_data *cntr,
+				  gboolean delta)
+{
+	struct counter_data from_layout = { 0 };
+	gint64 epoch_us = 0, period_us = 0;
+	gboolean have_base = FALSE;
+	const char *line, *layout;
+	int base = 0;
+	char *end;
+
+	if (!verify_state_checksum(buf))
+		return FALSE;
+
+	layout = strstr(buf, "\n" STATE_LAYOUT_KEY);
+	if (layout != NULL &&
+	    !parse_state_layout(layout + 1 + strlen(STATE_LAYOUT_KEY), &from_layout))
+		return FALSE;
+
+	cntr->counter = g_ascii_strtoll(buf, &end, 10);
+	if (end == buf)
+		return FALSE;
+
+	if (handoff_alarm_values == NULL)
+		handoff_alarm_values = g_array_new(FALSE, FALSE, sizeof(int));
+	g_array_set_size(handoff_alarm_values, 0);
+	handoff_pid = 0;
+
+	/* Older predecessors don't send a generation or their last tick */
+	cntr->generation = 0;
+	cntr->last_tick_us = 0;
+	if (!delta) {
+		cntr->history.start = 0;
+		cntr->history.count = 0;
+	}
+
+	for (line = strchr(buf, '\n'); line != NULL; line = strchr(line, '\n')) {
+		line++;
+		if (g_str_has_prefix(line, "generation ")) {
+			cntr->generation = g_ascii_strtoull(line + strlen("generation "),
+							    NULL, 10);
+		} else if (g_str_has_prefix(line, "history ")) {
+			gint64 time_us, value;
+
+			time_us = g_ascii_strtoll(line + strlen("history "), &end, 10);
+			value = g_ascii_strtoll(end, NULL, 10);
+			history_add(&cntr->history, time_us, value);
+		} else if (g_str_has_prefix(line, "epoch ")) {
+			epoch_us = g_ascii_strtoll(line + strlen("epoch "),
+						   NULL, 10);
+		} else if (g_str_has_prefix(line, "period ")) {
+			period_us = g_ascii_strtoll(line + strlen("period "),
+						    NULL, 10);
+		} else if (g_str_has_prefix(line, "base ")) {
+			base = g_ascii_strtoll(line + strlen("base "), NULL, 10);
+			have_base = TRUE;
+		} else if (g_str_has_prefix(line, "last_tick ")) {
+			cntr->last_tick_us = g_ascii_strtoll(line + strlen("last_tick "),
+							     NULL, 10);
+		} else if (g_str_has_prefix(line, "virtual_clock ")) {
+			gint64 now_us = g_ascii_strtoll(line + strlen("virtual_clock "),
+							NULL, 10);
+
+			if (virtual_clock)
+				virtual_now_us = MAX(virtual_now_us, now_us);
+		} else if (g_str_has_prefix(line, "alarm ")) {
+			int value = g_ascii_strtoll(line + strlen("alarm "),
+						    NULL, 10);
+
+			g_array_append_val(handoff_alarm_values, value);
+		} else if (g_str_has_prefix(line, "pid ")) {
+			handoff_pid = g_ascii_strtoll(line + strlen("pid "),
+						      NULL, 10);
+		}
+	}
+
+	adopt_state_clock(cntr, have_base, base, epoch_us, period_us);
+
+	if (layout != NULL) {
+		cntr->counter = from_layout.counter;
+		cntr->generation = from_layout.generation;
+		cntr->epoch_us = from_layout.epoch_us;
+		cntr->period_us = from_layout.period_us;
+	}
+
+	return TRUE;
+}
+
+static gboolean parse_state(const char *buf, struct counter_data *cntr)
+{
+	return parse_state_lines(buf, cntr, FALSE);
+}
+
+static gboolean parse_state_delta(const char *buf, struct counter_data *cntr)
+{
+	return parse_state_lines(buf, cntr, TRUE);
+}
+
+/*
+ * The state and the listening socket are kept in the systemd file descriptor
+ * store (FileDescriptorStoreMax=) so that they survive a crash or restart of
+ * the service without a predecessor to hand over the state. The state lives
+ * in a memfd that is mapped into memory, so refreshing it on every tick
+ * doesn't need any system calls. Only the counter, the generation and the
+ * clock are kept there, not the history.
+ *
+ * The memfd has a binary layout, which is updated and read in place without
+ * formatting or parsing. The header is followed by a table with the id,
+ * offset and size of each field, and then the fields, each aligned to its
+ * size. Readers look fields up in the table, so that later versions can add
+ * and move fields: a field that the reader doesn't know is skipped, unless
+ * it's marked as required, and a field that the writer didn't know keeps its
+ * default. The major version only changes when older readers can't use the
+ * state at all. The checksum covers everything after itself.
+ *
+ * The memfd has two slots of a page each, which are written in turn, so
+ * that the other one still holds the previous state while one is being
+ * written. The header has a sequence number, and the valid slot with the
+ * highest one is read. A memfd from a version before the binary layout holds
+ * the text state instead.
+ */
+
+#define SD_LISTEN_FDS_START 3
+
+#define STATE_LAYOUT_MAGIC "ESSTATE"
+#define STATE_LAYOUT_MAJOR 1
+#define STATE_LAYOUT_MINOR 0
+
+enum state_field_id {
+	STATE_FIELD_COUNTER = 1,
+	STATE_FIELD_GENERATION,
+	STATE_FIELD_BASE,
+	STATE_FIELD_EPOCH_US,
+	STATE_FIELD_PERIOD_US,
+	STATE_FIELD_VIRTUAL_NOW_US,
+	STATE_LAYOUT_FIELDS = STATE_FIELD_VIRTUAL_NOW_US,
+};
+
+/* Readers that don't know about the field have to reject the state */
+#define STATE_FIELD_REQUIRED 0x1
+
+struct state_layout_header {
+	char magic[8];
+	guint16 major;
+	guint16 minor;
+	/* Of the whole state, including the header */
+	guint32 size;
+	/* Of everything that follows it */
+	guint32 crc;
+	guint32 n_fields;
+	/* One higher on every write, over both slots */
+	guint64 sequence;
+};
+
+struct state_field {
+	guint16 id;
+	guint16 flags;
+	/* From the start of the header */
+	guint32 offset;
+	guint32 size;
+	guint32 reserved;
+};
+
+struct state_layout {
+	struct state_layout_header header;
+	struct state_field fields[STATE_LAYOUT_FIELDS];
+	gint64 epoch_us;
+	gint64 period_us;
+	gint64 virtual_now_us;
+	gint32 counter;
+	guint32 generation;
+	gint32 base;
+	guint32 reserved;
+};
+
+G_STATIC_ASSERT(sizeof(struct state_layout_header) % 8 == 0);
+G_STATIC_ASSERT(sizeof(struct state_field) % 8 == 0);
+G_STATIC_ASSERT(G_STRUCT_OFFSET(struct state_layout, epoch_us) % 8 == 0);
+
+/* The text state of older versions */
+#define STATE_TEXT_SIZE (STATE_HEADER_SIZE + STATE_CHECKSUM_SIZE)
+
+/* Later versions can grow the layout up to the size of a slot */
+#define STATE_SLOTS 2
+#define STATE_SLOT_SIZE 4096
+#define STATE_STORE_SIZE (STATE_SLOTS * STATE_SLOT_SIZE)
+
+G_STATIC_ASSERT(sizeof(struct state_layout) <= STATE_SLOT_SIZE);
+G_STATIC_ASSERT(STATE_TEXT_SIZE <= STATE_STORE_SIZE);
+
+static int state_fd = -1;
+static char *state_store;
+static gsize state_store_size;
+/* The slot that has the latest state, and its sequence number */
+static guint state_store_slot;
+static guint64 state_store_sequence;
+static int listener_fd = -1;
+#ifdef EARLY_SERVICE_MAIN
+static gboolean listener_stored = FALSE;
+#endif
+
+static gboolean store_fd(const char *name, int fd)
+{
+	const char *notify_socket = g_getenv("NOTIFY_SOCKET");
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	union {
+		struct cmsghdr cmsghdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control = { 0 };
+	struct msghdr msghdr = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char msg[64];
+	gsize len;
+	int sock;
+	int ret;
+
+	if (notify_socket == NULL)
+		return FALSE;
+
+	len = strlen(notify_socket);
+	if ((notify_socket[0] != '/' && notify_socket[0] != '@') ||
+	    len >= sizeof(sa.sun_path))
+		return FALSE;
+
+	memcpy(sa.sun_path, notify_socket, len);
+	if (sa.sun_path[0] == '@')
+		sa.sun_path[0] = '\0';
+
+	g_snprintf(msg, sizeof(msg), "FDSTORE=1\nFDNAME=%s", name);
+	iov.iov_base = msg;
+	iov.iov_len = strlen(msg);
+
+	msghdr.msg_name = &sa;
+	msghdr.msg_namelen = G_STRUCT_OFFSET(struct sockaddr_un, sun_path) + len;
+	msghdr.msg_iov = &iov;
+	msghdr.msg_iovlen = 1;
+	msghdr.msg_control = &control;
+	msghdr.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msghdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return FALSE;
+
+	ret = sendmsg(sock, &msghdr, MSG_NOSIGNAL);
+	close(sock);
+	if (ret < 0) {
+		g_warning("Error storing %s in the file descriptor store: %s",
+			  name, g_strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+#ifdef EARLY_SERVICE_MAIN
+/* Picks up the file descriptors that systemd passes back to us on restart */
+static void restore_fd_store(void)
+{
+	const char *listen_pid = g_getenv("LISTEN_PID");
+	const char *listen_fds = g_getenv("LISTEN_FDS");
+	gchar **names;
+	guint n_fds;
+
+	if (listen_pid == NULL || listen_fds == NULL ||
+	    g_ascii_strtoull(listen_pid, NULL, 10) != (guint64) getpid())
+		return;
+
+	n_fds = g_ascii_strtoull(listen_fds, NULL, 10);
+	names = g_strsplit(g_getenv("LISTEN_FDNAMES") ? : "", ":", -1);
+
+	for (guint i = 0; i < n_fds; i++) {
+		int fd = SD_LISTEN_FDS_START + i;
+		const char *name = i < g_strv_length(names) ? names[i] : "";
+
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		if (g_str_equal(name, "state") && state_fd < 0) {
+			state_fd = fd;
+		} else if (g_str_equal(name, "listener") && listener_fd < 0) {
+			listener_fd = fd;
+			listener_stored = TRUE;
+		} else {
+			close(fd);
+		}
+	}
+
+	g_strfreev(names);
+
+	g_unsetenv("LISTEN_PID");
+	g_unsetenv("LISTEN_FDS");
+	g_unsetenv("LISTEN_FDNAMES");
+}
+#endif
+
+static gboolean map_state_store(void)
+{
+	struct stat st;
+
+	/*
+	 * A store that was created by an older version can be smaller, and
+	 * one from a newer version larger, which is kept for reading it.
+	 */
+	if (fstat(state_fd, &st) < 0 ||
+	    ((gsize) st.st_size < STATE_STORE_SIZE &&
+	     ftruncate(state_fd, STATE_STORE_SIZE) < 0)) {
+		g_warning("Error resizing state: %s", g_strerror(errno));
+		close(state_fd);
+		state_fd = -1;
+		return FALSE;
+	}
+
+	state_store_size = MAX((gsize) st.st_size, STATE_STORE_SIZE);
+	state_store = mmap(NULL, state_store_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, state_fd, 0);
+	if (state_store == MAP_FAILED) {
+		g_warning("Error mapping state: %s", g_strerror(errno));
+		state_store = NULL;
+		close(state_fd);
+		state_fd = -1;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static struct state_layout *state_slot(guint slot)
+{
+	return (struct state_layout *) (state_store + slot * STATE_SLOT_SIZE);
+}
+
+static gboolean state_slot_has_layout(guint slot)
+{
+	return memcmp(state_slot(slot)->header.magic, STATE_LAYOUT_MAGIC,
+		      sizeof(STATE_LAYOUT_MAGIC)) == 0;
+}
+
+static guint32 state_layout_crc(const void *state, gsize size)
+{
+	gsize start = G_STRUCT_OFFSET(struct state_layout_header, n_fields);
+
+	return crc32c((const char *) state + start, size - start);
+}
+
+static gboolean read_state_field(const char *state,
+				 const struct state_field *field,
+				 void *value, gsize size)
+{
+	if (field->size != size || field->offset % size != 0) {
+		g_warning("State field %u has an invalid size or alignment",
+			  field->id);
+		return FALSE;
+	}
+
+	memcpy(value, state + field->offset, size);
+	return TRUE;
+}
+
+static gboolean read_state_layout(const char *state, gsize len,
+				  struct counter_data *cntr)
+{
+	const struct state_layout_header *header = (const void *) state;
+	const struct state_field *fields = (const void *) (header + 1);
+	gint64 epoch_us = 0, period_us = 0, virtual_now = 0;
+	gboolean have_base = FALSE;
+	gint32 counter = 0, base = 0;
+	guint32 generation = 0;
+	gboolean ok = TRUE;
+
+	if (len < sizeof(*header)) {
+		g_warning("The state is too short for its header");
+		return FALSE;
+	}
+
+	if (header->major != STATE_LAYOUT_MAJOR) {
+		g_warning("Can't read version %u.%u of the state, only version %u",
+			  header->major, header->minor, STATE_LAYOUT_MAJOR);
+		return FALSE;
+	}
+
+	if (header->size < sizeof(*header) || header->size > len ||
+	    header->n_fields > (header->size - sizeof(*header)) / sizeof(*fields)) {
+		g_warning("The state has an invalid size");
+		state_corrupted = TRUE;
+		return FALSE;
+	}
+
+	if (state_layout_crc(state, header->size) != header->crc) {
+		g_warning("The state is corrupted, it doesn't match its CRC32C");
+		state_corrupted = TRUE;
+		return FALSE;
+	}
+
+	for (guint i = 0; i < header->n_fields && ok; i++) {
+		const struct state_field *field = &fields[i];
+
+		if (field->offset > header->size ||
+		    field->size > header->size - field->offset) {
+			g_warning("State field %u is out of bounds", field->id);
+			return FALSE;
+		}
+
+		switch (field->id) {
+		case STATE_FIELD_COUNTER:
+			ok = read_state_field(state, field, &counter, sizeof(counter));
+			break;
+		case STATE_FIELD_GENERATION:
+			ok = read_state_field(state, field, &generation,
+					      sizeof(generation));
+			break;
+		case STATE_FIELD_BASE:
+			ok = have_base = read_state_field(state, field, &base,
+							  sizeof(base));
+			break;
+		case STATE_FIELD_EPOCH_US:
+			ok = read_state_field(state, field, &epoch_us,
+					      sizeof(epoch_us));
+			break;
+		case STATE_FIELD_PERIOD_US:
+			ok = read_state_field(state, field, &period_us,
+					      sizeof(period_us));
+			break;
+		case STATE_FIELD_VIRTUAL_NOW_US:
+			ok = read_state_field(state, field, &virtual_now,
+					      sizeof(virtual_now));
+			break;
+		default:
+			if (field->flags & STATE_FIELD_REQUIRED) {
+				g_warning("Can't read the state, it has the unknown field %u",
+					  field->id);
+				return FALSE;
+			}
+			break;
+		}
+	}
+
+	if (!ok)
+		return FALSE;
+
+	cntr->counter = counter;
+	cntr->generation = generation;
+	if (virtual_clock)
+		virtual_now_us = MAX(virtual_now_us, virtual_now);
+	adopt_state_clock(cntr, have_base, base, epoch_us, period_us);
+
+	g_debug("Read version %u.%u of the state with %u fields", header->major,
+		header->minor, header->n_fields);
+	return TRUE;
+}
+
+/*
+ * When the latest slot is corrupted, we crashed while writing it, and the
+ * other one has the state from the tick before.
+ */
+static gboolean read_state_from_fd_store(struct counter_data *cntr)
+{
+	char buf[STATE_TEXT_SIZE + 1];
+	guint latest;
+
+	if (state_fd < 0 || !map_state_store())
+		return FALSE;
+
+	if (!state_slot_has_layout(0) && !state_slot_has_layout(1)) {
+		memcpy(buf, state_store, STATE_TEXT_SIZE);
+		buf[STATE_TEXT_SIZE] = '\0';
+
+		return parse_state(buf, cntr);
+	}
+
+	latest = state_slot_has_layout(1) &&
+		 (!state_slot_has_layout(0) ||
+		  state_slot(1)->header.sequence > state_slot(0)->header.sequence);
+
+	for (guint i = 0; i < STATE_SLOTS; i++) {
+		guint slot = (latest + i) % STATE_SLOTS;
+
+		if (!state_slot_has_layout(slot) ||
+		    !read_state_layout((const char *) state_slot(slot),
+				       STATE_SLOT_SIZE, cntr))
+			continue;
+
+		if (slot != latest)
+			g_message("Read the previous state from the file descriptor store");
+
+		/* The history isn't kept in the store */
+		cntr->history.start = 0;
+		cntr->history.count = 0;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+#define STATE_LAYOUT_FIELD(field_id, member) \
+	{ .id = field_id, .offset = G_STRUCT_OFFSET(struct state_layout, member), \
+	  .size = sizeof(((struct state_layout *) NULL)->member) }
+
+static const struct state_field state_layout_fields[STATE_LAYOUT_FIELDS] = {
+	STATE_LAYOUT_FIELD(STATE_FIELD_COUNTER, counter),
+	STATE_LAYOUT_FIELD(STATE_FIELD_GENERATION, generation),
+	STATE_LAYOUT_FIELD(STATE_FIELD_BASE, base),
+	STATE_LAYOUT_FIELD(STATE_FIELD_EPOCH_US, epoch_us),
+	STATE_LAYOUT_FIELD(STATE_FIELD_PERIOD_US, period_us),
+	STATE_LAYOUT_FIELD(STATE_FIELD_VIRTUAL_NOW_US, virtual_now_us),
+};
+
+static void init_state_layout(struct state_layout *layout)
+{
+	memset(layout, 0, sizeof(*layout));
+	memcpy(layout->header.magic, STATE_LAYOUT_MAGIC, sizeof(STATE_LAYOUT_MAGIC));
+	layout->header.major = STATE_LAYOUT_MAJOR;
+	layout->header.minor = STATE_LAYOUT_MINOR;
+	layout->header.size = sizeof(*layout);
+	layout->header.n_fields = STATE_LAYOUT_FIELDS;
+	memcpy(layout->fields, state_layout_fields, sizeof(state_layout_fields));
+}
+
+static void fill_state_layout(struct state_layout *layout,
+			      struct counter_data *cntr)
+{
+	int base = g_atomic_int_get(&cntr->counter);
+
+	layout->counter = cntr->epoch_us == 0 ? base :
+		(int) ((unsigned int) base + counter_ticks(cntr));
+	layout->generation = cntr->generation;
+	layout->base = base;
+	layout->epoch_us = cntr->epoch_us;
+	layout->period_us = cntr->period_us;
+	layout->virtual_now_us = virtual_now_us;
+}
+
+/* A store that was restored from an older version is rewritten in our layout */
+static void create_state_store(void)
+{
+	if (state_store == NULL) {
+		if (g_getenv("NOTIFY_SOCKET") == NULL)
+			return;
+
+		state_fd = memfd_create("early-service-state", MFD_CLOEXEC);
+		if (state_fd < 0) {
+			g_warning("Error creating memfd: %s", g_strerror(errno));
+			return;
+		}
+
+		if (!map_state_store())
+			return;
+
+		store_fd("state", state_fd);
+	}
+
+	memset(state_store, 0, state_store_size);
+	for (guint slot = 0; slot < STATE_SLOTS; slot++)
+		init_state_layout(state_slot(slot));
+}
+
+/*
+ * Writes the slot that doesn't have the latest state. It only becomes the
+ * latest once its checksum is written.
+ */
+static void store_state(struct counter_data *cntr)
+{
+	guint slot = (state_store_slot + 1) % STATE_SLOTS;
+	struct state_layout *layout;
+
+	if (state_store == NULL)
+		return;
+
+	layout = state_slot(slot);
+	fill_state_layout(layout, cntr);
+	layout->header.sequence = ++state_store_sequence;
+	layout->header.crc = state_layout_crc(layout, sizeof(*layout));
+	state_store_slot = slot;
+}
+
+static void format_state_layout(struct counter_data *cntr, GString *out)
+{
+	struct state_layout layout;
+	gchar *encoded;
+
+	init_state_layout(&layout);
+	fill_state_layout(&layout, cntr);
+	layout.header.crc = state_layout_crc(&layout, sizeof(layout));
+
+	encoded = g_base64_encode((const guchar *) &layout, sizeof(layout));
+	g_string_append_printf(out, STATE_LAYOUT_KEY "%s\n", encoded);
+	g_free(encoded);
+}
+
+/* The value runs up to the end of the line */
+static gboolean parse_state_layout(const char *value, struct counter_data *cntr)
+{
+	gchar *encoded = g_strndup(value, strcspn(value, "\n"));
+	guchar *state;
+	gboolean ret;
+	gsize len;
+
+	state = g_base64_decode(encoded, &len);
+	ret = read_state_layout((const char *) state, len, cntr);
+	g_free(state);
+	g_free(encoded);
+
+	return ret;
+}
+
+/*
+ * The reply to get_counter is rendered once for each value of the counter,
+ * when it changes or when it's first asked for, and then sent straight from
+ * the cache. Replies that are waiting to be written hold a reference on
+ * their entry. An entry is only rewritten once it's no longer the published
+ * one, and no reply or writer uses it, so that readers never need a lock: a
+ * reader takes a reference on the published entry, and then checks that it
+ * was still published, like with RCU.
+ */
+
+#define REPLY_CACHE_ENTRIES 4
+
+struct reply_cache_entry {
+	gint users;
+	int value;
+	gsize len;
+	char text[16];
+};
+
+static struct reply_cache_entry reply_cache[REPLY_CACHE_ENTRIES];
+static struct reply_cache_entry *reply_cache_current;
+
+static void reply_cache_put(struct reply_cache_entry *entry)
+{
+	g_atomic_int_dec_and_test(&entry->users);
+}
+
+/* Returns a reference to the cached reply for value, if there is one */
+static struct reply_cache_entry *reply_cache_get(int value)
+{
+	struct reply_cache_entry *entry = g_atomic_pointer_get(&reply_cache_current);
+
+	if (entry == NULL || g_atomic_int_get(&entry->value) != value)
+		return NULL;
+
+	g_atomic_int_inc(&entry->users);
+	if (entry != g_atomic_pointer_get(&reply_cache_current) ||
+	    g_atomic_int_get(&entry->value) != value) {
+		reply_cache_put(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/*
+ * Renders the reply for value into an unused entry and publishes it. Returns
+ * a reference to it, or NULL when all of the entries are still in use.
+ */
+static struct reply_cache_entry *reply_cache_publish(int value)
+{
+	for (guint i = 0; i < REPLY_CACHE_ENTRIES; i++) {
+		struct reply_cache_entry *entry = &reply_cache[i];
+
+		if (!g_atomic_int_compare_and_exchange(&entry->users, 0, 1))
+			continue;
+
+		if (entry == g_atomic_pointer_get(&reply_cache_current)) {
+			reply_cache_put(entry);
+			continue;
+		}
+
+		g_atomic_int_set(&entry->value, value);
+		entry->len = g_snprintf(entry->text, sizeof(entry->text),
+					"%d\n", value);
+		g_atomic_pointer_set(&reply_cache_current, entry);
+
+		return entry;
+	}
+
+	return NULL;
+}
+
+static void reply_cache_update(int value)
+{
+	struct reply_cache_entry *entry = reply_cache_publish(value);
+
+	if (entry != NULL)
+		reply_cache_put(entry);
+}
+
+/*
+ * Operations on the counter. Each one changes the counter word with a single
+ * lock-free atomic operation. Only that word is safe to change from more
+ * than one thread: store_state(), the history and the reply cache that
+ * counter_changed() updates expect the main loop. The arithmetic wraps
+ * around instead of overflowing. A tickless counter only
+ * keeps its base value in cntr->counter, so the ticks since the epoch are
+ * added to it on the way out, and subtracted from new values on the way in.
+ */
+
+static void alarms_check(struct counter_data *cntr, int counter);
+
+/* Called after every change of the counter, with the new value */
+static void counter_changed(struct counter_data *cntr, int value)
+{
+	store_state(cntr);
+	reply_cache_update(value);
+	alarms_check(cntr, value);
+
+	/* Without ticks, the history gets a sample on every change instead */
+	if (cntr->epoch_us != 0)
+		history_add(&cntr->history, clock_boottime_us(), value);
+}
+
+static int counter_get(struct counter_data *cntr)
+{
+	return (int) ((unsigned int) g_atomic_int_get(&cntr->counter) +
+		      counter_ticks(cntr));
+}
+
+/* Returns the previous value, which is equal to expected on success */
+static int counter_cas(struct counter_data *cntr, int expected, int value)
+{
+	unsigned int ticks = counter_ticks(cntr);
+	int base, prev;
+
+	do {
+		base = g_atomic_int_get(&cntr->counter);
+		prev = (int) ((unsigned int) base + ticks);
+		if (prev != expected)
+			return prev;
+	} while (!g_atomic_int_compare_and_exchange(&cntr->counter, base,
+						    (int) ((unsigned int) value - ticks)));
+
+	counter_changed(cntr, value);
+
+	return prev;
+}
+
+/* Returns the previous value */
+static int counter_set(struct counter_data *cntr, int value)
+{
+	unsigned int ticks = counter_ticks(cntr);
+	int base;
+
+	do {
+		base = g_atomic_int_get(&cntr->counter);
+	} while (!g_atomic_int_compare_and_exchange(&cntr->counter, base,
+						    (int) ((unsigned int) value - ticks)));
+
+	counter_changed(cntr, value);
+
+	return (int) ((unsigned int) base + ticks);
+}
+
+/* Returns the previous value */
+static int counter_fetch_add(struct counter_data *cntr, int delta)
+{
+	unsigned int ticks = counter_ticks(cntr);
+	int prev = (int) ((unsigned int) g_atomic_int_add(&cntr->counter, delta) +
+			  ticks);
+
+	counter_changed(cntr, (int) ((unsigned int) prev + (unsigned int) delta));
+
+	return prev;
+}
+
+/* Returns the new value */
+static int counter_add(struct counter_data *cntr, int delta)
+{
+	return (int) ((unsigned int) counter_fetch_add(cntr, delta) +
+		      (unsigned int) delta);
+}
+
+#ifdef EARLY_SERVICE_MAIN
+/*
+ * Starts the clock of a tickless counter. When it was taken over from a
+ * tickless predecessor with the same period it simply continues. Otherwise
+ * the current value becomes the base. A new epoch is one period in the past,
+ * so that the first tick happens right away, like it does when ticking.
+ */
+static void counter_clock_init(struct counter_data *cntr)
+{
+	gint64 period_us = (gint64) timer_delay_ms * 1000;
+	gint64 now_us;
+
+	if (!tickless || (cntr->epoch_us != 0 && cntr->period_us == period_us))
+		return;
+
+	now_us = clock_boottime_us();
+	if (cntr->epoch_us != 0) {
+		cntr->counter = counter_get(cntr);
+		cntr->epoch_us = now_us;
+	} else {
+		cntr->epoch_us = MAX(now_us - period_us, 1);
+	}
+	cntr->period_us = period_us;
+}
+
+/*
+ * With --startup_trace, the time from exec to each of the startup steps is
+ * logged. The exec time comes from /proc/self/stat, which only has a
+ * resolution of one clock tick (usually 10 ms), so the time since main() was
+ * entered is logged as well.
+ */
+
+static gint64 main_time_us;
+static gint64 exec_time_us = -1;
+
+static void startup_trace_init(void)
+{
+	gchar *stat, *pos;
+	guint64 starttime;
+
+	main_time_us = get_boottime_us();
+
+	if (!startup_trace ||
+	    !g_file_get_contents("/proc/self/stat", &stat, NULL, NULL))
+		return;
+
+	/* The start time is the 22nd field; the 2nd one can contain spaces */
+	pos = strrchr(stat, ')');
+	for (int field = 2; pos != NULL && field < 22; field++)
+		pos = strchr(pos + 1, ' ');
+
+	if (pos != NULL) {
+		starttime = g_ascii_strtoull(pos + 1, NULL, 10);
+		exec_time_us = starttime * G_USEC_PER_SEC / sysconf(_SC_CLK_TCK);
+	}
+
+	g_free(stat);
+}
+
+static void trace_startup_step(const char *step)
+{
+	gint64 now;
+
+	if (!startup_trace)
+		return;
+
+	now = get_boottime_us();
+	g_message("startup: %s at %" G_GINT64_FORMAT " us after exec, %"
+		  G_GINT64_FORMAT " us after main", step,
+		  exec_time_us >= 0 ? now - exec_time_us : -1,
+		  now - main_time_us);
+}
+#endif
+
+/* The benchmark measures the ticks too */
+#if defined(EARLY_SERVICE_MAIN) || defined(EARLY_SERVICE_BENCHMARK)
+static gboolean timer_callback(gpointer data)
+{
+	struct counter_data *cntr = data;
+
+	int counter = counter_fetch_add(cntr, 1);
+
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, NULL, counter,
+			      LOG_NO_VALUE, "%d", counter);
+	cntr->last_tick_us = clock_boottime_us();
+	history_add(&cntr->history, cntr->last_tick_us, counter);
+
+	return G_SOURCE_CONTINUE;
+}
+#endif
+
+#ifdef EARLY_SERVICE_MAIN
+static gboolean first_tick_callback(gpointer data)
+{
+	timer_callback(data);
+	trace_startup_step("first tick");
+
+	return G_SOURCE_REMOVE;
+}
+
+static guint tick_source_id;
+
+static void start_ticking(struct counter_data *cntr)
+{
+	tick_source_id = clock_timeout_add(timer_delay_ms, timer_callback, cntr);
+	g_idle_add_full(G_PRIORITY_HIGH, first_tick_callback, cntr, NULL);
+}
+
+static gboolean resume_tick_callback(gpointer data)
+{
+	struct counter_data *cntr = data;
+
+	tick_source_id = clock_timeout_add(timer_delay_ms, timer_callback, cntr);
+	first_tick_callback(cntr);
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * After a handoff, the predecessor already counted the tick at last_tick_us,
+ * so the next one is due a period after that, and not right away like on a
+ * fresh start. A predecessor that doesn't send it is treated like one.
+ */
+static void resume_ticking(struct counter_data *cntr)
+{
+	gint64 delay_us;
+
+	if (cntr->last_tick_us == 0) {
+		start_ticking(cntr);
+		return;
+	}
+
+	delay_us = cntr->last_tick_us + (gint64) timer_delay_ms * 1000 -
+		   clock_boottime_us();
+	tick_source_id = clock_timeout_add((MAX(delay_us, 0) + 999) / 1000,
+					   resume_tick_callback, cntr);
+}
+#endif
+
+/*
+ * A predecessor that handed over its state keeps running for a little while,
+ * until it has sent everything and exits. Ticking while it still ticks would
+ * count twice, and waiting longer than needed would leave a gap, so we wait
+ * on a pidfd of the predecessor and start ticking as soon as it's gone. The
+ * wait is on the real clock, since it depends on another process. If the
+ * predecessor doesn't exit in time, we start anyway and log the overlap.
+ */
+
+#define PREDECESSOR_EXIT_TIMEOUT_MS 1000
+
+static int predecessor_pidfd = -1;
+static pid_t predecessor_pid;
+static gint64 state_received_us;
+
+#ifdef EARLY_SERVICE_MAIN
+static gint64 ticking_started_us;
+static guint predecessor_timeout_id;
+
+static gboolean predecessor_exited_callback(gint fd, GIOCondition condition,
+					    gpointer user_data)
+{
+	struct counter_data *cntr = user_data;
+	gint64 now_us = g_get_monotonic_time();
+
+	if (ticking_started_us != 0) {
+		log_event(G_LOG_LEVEL_WARNING, NULL, LOG_NO_VALUE,
+			  now_us - ticking_started_us,
+			  "Predecessor %d exited after we started ticking, the overlap was %"
+			  G_GINT64_FORMAT " us", predecessor_pid,
+			  now_us - ticking_started_us);
+	} else {
+		log_event(G_LOG_LEVEL_MESSAGE, NULL, LOG_NO_VALUE,
+			  now_us - state_received_us,
+			  "Predecessor %d exited, the gap since the handoff was %"
+			  G_GINT64_FORMAT " us", predecessor_pid,
+			  now_us - state_received_us);
+		if (!tickless)
+			resume_ticking(cntr);
+	}
+
+	if (predecessor_timeout_id != 0) {
+		g_source_remove(predecessor_timeout_id);
+		predecessor_timeout_id = 0;
+	}
+	close(predecessor_pidfd);
+	predecessor_pidfd = -1;
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean predecessor_timeout_callback(gpointer user_data)
+{
+	struct counter_data *cntr = user_data;
+
+	g_warning("Predecessor %d is still running after %d ms, starting to tick anyway",
+		  predecessor_pid, PREDECESSOR_EXIT_TIMEOUT_MS);
+
+	predecessor_timeout_id = 0;
+	ticking_started_us = g_get_monotonic_time();
+	resume_ticking(cntr);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void wait_for_predecessor(struct counter_data *cntr)
+{
+	g_unix_fd_add(predecessor_pidfd, G_IO_IN, predecessor_exited_callback,
+		      cntr);
+	if (!tickless)
+		predecessor_timeout_id = g_timeout_add(PREDECESSOR_EXIT_TIMEOUT_MS,
+						       predecessor_timeout_callback,
+						       cntr);
+}
+#endif
+
+/*
+ * Timers that there can be many of, such as the deadlines of the client
+ * connections, are kept in a hierarchical timer wheel, so that arming,
+ * cancelling and expiring one is O(1) no matter how many there are. Level 0
+ * has a slot for each of the next 64 ticks, and every level above it has
+ * slots that are 64 times as long. When a level has gone around, the timers
+ * in the next slot of the level above are moved down. A single GSource drives
+ * the wheel. It only runs while there are timers, and sleeps until the next
+ * tick that has timers on level 0, or that timers are moved down at.
+ */
+
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+static struct {
+	struct wheel_timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+	/* The next tick to run */
+	guint64 now;
+	guint n_timers;
+	guint source_id;
+	guint64 source_tick;
+} timer_wheel;
+
+static guint64 timer_wheel_current_tick(void)
+{
+	return clock_monotonic_us() / (TIMER_WHEEL_TICK_MS * 1000);
+}
+
+static void timer_wheel_link(struct wheel_timer *timer)
+{
+	guint64 max_delta = ((guint64) 1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+	guint64 expires = timer->expires, delta;
+	struct wheel_timer **slot;
+	guint level;
+
+	/* Timers that are already due run on the next tick */
+	if (expires < timer_wheel.now)
+		expires = timer_wheel.now;
+
+	/*
+	 * Timers that are further out than the wheel reaches go in the last
+	 * slot it does. timer->expires keeps the real deadline, so they are
+	 * put back further out again when that slot is moved down.
+	 */
+	delta = MIN(expires - timer_wheel.now, max_delta);
+	expires = timer_wheel.now + delta;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (guint64) 1 << ((level + 1) * TIMER_WHEEL_BITS))
+			break;
+	}
+
+	slot = &timer_wheel.slots[level][(expires >> (level * TIMER_WHEEL_BITS)) &
+					 TIMER_WHEEL_MASK];
+	timer->next = *slot;
+	if (timer->next != NULL)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+static void timer_wheel_unlink(struct wheel_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+}
+
+static void timer_wheel_cancel(struct wheel_timer *timer)
+{
+	if (timer->pprev == NULL)
+		return;
+
+	timer_wheel_unlink(timer);
+	timer_wheel.n_timers--;
+}
+
+/* Returns the index of the slot that the timers were moved down from */
+static guint timer_wheel_cascade(guint level)
+{
+	guint index = (timer_wheel.now >> (level * TIMER_WHEEL_BITS)) &
+		      TIMER_WHEEL_MASK;
+	struct wheel_timer *timer = timer_wheel.slots[level][index], *next;
+
+	timer_wheel.slots[level][index] = NULL;
+	for (; timer != NULL; timer = next) {
+		next = timer->next;
+		timer_wheel_link(timer);
+	}
+
+	return index;
+}
+
+static void timer_wheel_run_tick(void)
+{
+	guint64 tick = timer_wheel.now;
+	guint index = tick & TIMER_WHEEL_MASK;
+	struct wheel_timer *expired, *timer;
+
+	if (index == 0) {
+		for (guint level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			if (timer_wheel_cascade(level) != 0)
+				break;
+		}
+	}
+
+	/*
+	 * The expired timers are moved to a list of their own, so that timers
+	 * that are armed by the callbacks end up in the next tick.
+	 */
+	expired = timer_wheel.slots[0][index];
+	timer_wheel.slots[0][index] = NULL;
+	if (expired != NULL)
+		expired->pprev = &expired;
+	timer_wheel.now++;
+
+	while ((timer = expired) != NULL) {
+		timer_wheel_unlink(timer);
+		if (timer->expires > tick) {
+			timer_wheel_link(timer);
+			continue;
+		}
+		timer_wheel.n_timers--;
+		timer->callback(timer);
+	}
+}
+
+/*
+ * The next tick that has timers on level 0, or that timers are moved down to
+ * it at. Both wrap around into the next round of their level.
+ */
+static guint64 timer_wheel_next_tick(void)
+{
+	guint64 next = G_MAXUINT64;
+
+	for (guint i = 0; i < TIMER_WHEEL_SIZE; i++) {
+		if (timer_wheel.slots[0][(timer_wheel.now + i) & TIMER_WHEEL_MASK] != NULL) {
+			next = timer_wheel.now + i;
+			break;
+		}
+	}
+
+	for (guint level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		guint shift = level * TIMER_WHEEL_BITS;
+		guint64 round = timer_wheel.now >> shift;
+		/* The current slot hasn't been moved down yet on the first tick */
+		guint first = (round << shift) == timer_wheel.now ? 0 : 1;
+
+		for (guint i = first; i <= TIMER_WHEEL_SIZE; i++) {
+			if (timer_wheel.slots[level][(round + i) & TIMER_WHEEL_MASK] != NULL) {
+				next = MIN(next, (round + i) << shift);
+				break;
+			}
+		}
+	}
+
+	return next;
+}
+
+static void timer_wheel_schedule(void);
+
+static gboolean timer_wheel_callback(gpointer data)
+{
+	guint64 tick = timer_wheel_current_tick(), next;
+
+	/* Nothing happens on the ticks in between, so they are skipped */
+	while (timer_wheel.n_timers > 0 &&
+	       (next = timer_wheel_next_tick()) <= tick) {
+		timer_wheel.now = MAX(timer_wheel.now, next);
+		timer_wheel_run_tick();
+	}
+
+	timer_wheel.now = MAX(timer_wheel.now, tick + 1);
+
+	timer_wheel.source_id = 0;
+	timer_wheel_schedule();
+
+	return G_SOURCE_REMOVE;
+}
+
+static void timer_wheel_schedule(void)
+{
+	guint64 next, tick;
+
+	if (timer_wheel.n_timers == 0)
+		return;
+
+	next = timer_wheel_next_tick();
+	if (timer_wheel.source_id != 0) {
+		if (timer_wheel.source_tick <= next)
+			return;
+		clock_source_remove(timer_wheel.source_id);
+	}
+
+	tick = timer_wheel_current_tick();
+	timer_wheel.source_tick = next;
+	timer_wheel.source_id = clock_timeout_add(next > tick ?
+						  (next - tick) * TIMER_WHEEL_TICK_MS : 0,
+						  timer_wheel_callback, NULL);
+}
+
+/*
+ * Arms the timer to run in timeout_ms, replacing the time it was armed for.
+ * The time is rounded up to the next tick, so the timer never runs early.
+ */
+static void timer_wheel_arm(struct wheel_timer *timer, guint timeout_ms)
+{
+	gint64 now_us = clock_monotonic_us();
+	gint64 tick_us = TIMER_WHEEL_TICK_MS * 1000;
+
+	timer_wheel_cancel(timer);
+
+	/* Nothing can be missed when the wheel is empty */
+	if (timer_wheel.n_timers == 0)
+		timer_wheel.now = MAX(timer_wheel.now, (guint64) (now_us / tick_us));
+
+	timer->expires = (now_us + (gint64) timeout_ms * 1000 + tick_us - 1) /
+			 tick_us;
+	timer_wheel_link(timer);
+	timer_wheel.n_timers++;
+
+	timer_wheel_schedule();
+}
+
+/*
+ * The next block of functions are for the server that's exposed on a UNIX
+ * domain socket. This is all done with asynchronous IO so that nothing will
+ * block the glib main loop.
+ */
+
+static GSocketService *service;
+
+/*
+ * The connection_info objects are preallocated up front, so that serving a
+ * request doesn't need to go through the allocator. When all of them are in
+ * use, the server stops accepting new connections until one is released.
+ * Those clients wait in the listen backlog of the kernel in the meantime.
+ */
+static struct connection_info *connection_free_list;
+static gboolean accept_paused = FALSE;
+
+/* The benchmark gets connections from the pool too */
+#if defined(EARLY_SERVICE_MAIN) || defined(EARLY_SERVICE_BENCHMARK)
+static struct connection_info *connection_pool;
+
+static gboolean connection_pool_init(void)
+{
+	if (connection_pool_size <= 0) {
+		g_warning("Invalid connection pool size %d",
+			  connection_pool_size);
+		return FALSE;
+	}
+
+	if (posix_memalign((void **) &connection_pool, CACHE_LINE_SIZE,
+			   connection_pool_size * sizeof(*connection_pool)) != 0) {
+		g_warning("Error allocating the connection pool");
+		return FALSE;
+	}
+
+	for (gint i = connection_pool_size - 1; i >= 0; i--) {
+		connection_pool[i].reply = g_string_sized_new(64);
+		connection_pool[i].cancellable = g_cancellable_new();
+		connection_pool[i].next_free = connection_free_list;
+		connection_free_list = &connection_pool[i];
+	}
+
+	return TRUE;
+}
+
+static struct connection_info *connection_pool_get(void)
+{
+	struct connection_info *conn = connection_free_list;
+	GCancellable *cancellable;
+	GString *reply;
+
+	if (conn == NULL)
+		return NULL;
+
+	connection_free_list = conn->next_free;
+	reply = conn->reply;
+	cancellable = conn->cancellable;
+	memset(conn, 0, sizeof(*conn));
+	conn->reply = g_string_truncate(reply, 0);
+	conn->cancellable = cancellable;
+	g_cancellable_reset(cancellable);
+
+	if (connection_free_list == NULL && !accept_paused) {
+		g_message("All %d connections in use, not accepting new connections",
+			  connection_pool_size);
+		g_socket_service_stop(service);
+		accept_paused = TRUE;
+	}
+
+	return conn;
+}
+#endif
+
+static void connection_pool_put(struct connection_info *conn)
+{
+	conn->next_free = connection_free_list;
+	connection_free_list = conn;
+
+	if (accept_paused) {
+		g_message("Accepting new connections again");
+		g_socket_service_start(service);
+		accept_paused = FALSE;
+	}
+}
+
+/*
+ * Admission control happens before a connection gets an entry from the pool.
+ * Connections that are above the global limit, or above the limit for the
+ * user on the other end, get a busy reply right away and are closed. This
+ * keeps a single misbehaving client from using up all of the connections.
+ */
+static guint active_connections;
+static GHashTable *connections_per_uid;
+
+#define SERVER_BUSY_REPLY "busy\n"
+
+static pid_t get_peer_pid(GSocketConnection *connection)
+{
+	GCredentials *credentials;
+	pid_t pid;
+
+	credentials = g_socket_get_credentials(g_socket_connection_get_socket(connection),
+					       NULL);
+	if (credentials == NULL)
+		return -1;
+
+	pid = g_credentials_get_unix_pid(credentials, NULL);
+	g_object_unref(credentials);
+
+	return pid;
+}
+
+#ifdef EARLY_SERVICE_MAIN
+static uid_t get_peer_uid(GSocketConnection *connection)
+{
+	GCredentials *credentials;
+	uid_t uid;
+
+	credentials = g_socket_get_credentials(g_socket_connection_get_socket(connection),
+					       NULL);
+	if (credentials == NULL)
+		return (uid_t) -1;
+
+	uid = g_credentials_get_unix_user(credentials, NULL);
+	g_object_unref(credentials);
+
+	return uid;
+}
+
+static gboolean admit_connection(GSocketConnection *connection, uid_t uid)
+{
+	guint uid_connections;
+
+	if (connections_per_uid == NULL)
+		connections_per_uid = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	uid_connections = GPOINTER_TO_UINT(g_hash_table_lookup(connections_per_uid,
+							       GUINT_TO_POINTER(uid)));
+
+	if ((max_connections > 0 && active_connections >= (guint) max_connections) ||
+	    (max_connections_per_uid > 0 &&
+	     uid_connections >= (guint) max_connections_per_uid)) {
+		/* Don't wait for the client; it's dropped if it can't take it */
+		g_socket_send_with_blocking(g_socket_connection_get_socket(connection),
+					    SERVER_BUSY_REPLY,
+					    strlen(SERVER_BUSY_REPLY),
+					    FALSE, NULL, NULL);
+		return FALSE;
+	}
+
+	active_connections++;
+	g_hash_table_insert(connections_per_uid, GUINT_TO_POINTER(uid),
+			    GUINT_TO_POINTER(uid_connections + 1));
+
+	return TRUE;
+}
+
+#endif
+
+static void release_connection(uid_t uid)
+{
+	guint uid_connections;
+
+	uid_connections = GPOINTER_TO_UINT(g_hash_table_lookup(connections_per_uid,
+							       GUINT_TO_POINTER(uid)));
+	if (uid_connections <= 1)
+		g_hash_table_remove(connections_per_uid, GUINT_TO_POINTER(uid));
+	else
+		g_hash_table_insert(connections_per_uid, GUINT_TO_POINTER(uid),
+				    GUINT_TO_POINTER(uid_connections - 1));
+
+	active_connections--;
+}
+
+static void server_reset_output(struct connection_info *conn);
+static void alarm_remove(struct connection_info *conn);
+static void alarm_unqueue(struct connection_info *conn);
+
+void server_free_connection(struct connection_info *conn)
+{
+	gboolean terminate = conn->terminate_at_end;
+
+	/* Releases the cached replies that were never sent */
+	server_reset_output(conn);
+	timer_wheel_cancel(&conn->deadline);
+	if (conn->alarm_pending)
+		alarm_remove(conn);
+	if (conn->alarm_queued)
+		alarm_unqueue(conn);
+
+	g_object_unref(G_SOCKET_CONNECTION(conn->connection));
+	release_connection(conn->uid);
+	connection_pool_put(conn);
+
+	if (terminate) {
+		handed_off = TRUE;
+		g_main_loop_quit(loop);
+	}
+}
+
+static void server_process_input(struct connection_info *conn);
+
+/*
+ * Every connection has a deadline while it's waiting for the client: for the
+ * next command when it's idle, for the rest of a command that was partially
+ * read, and for the client to take the replies that are being written. When
+ * the deadline passes, the read or write is cancelled, which closes the
+ * connection. The number of connections that were closed like that can be
+ * queried with the expired_connections command.
+ */
+
+static const char *deadline_names[N_DEADLINES] = {
+	[DEADLINE_IDLE] = "idle",
+	[DEADLINE_READ] = "read",
+	[DEADLINE_WRITE] = "write",
+};
+
+static guint expired_connections[N_DEADLINES];
+
+static void server_deadline_expired(struct wheel_timer *timer)
+{
+	struct connection_info *conn = (struct connection_info *)
+		((char *) timer - G_STRUCT_OFFSET(struct connection_info, deadline));
+
+	expired_connections[conn->deadline_type]++;
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command, LOG_NO_VALUE,
+			      LOG_NO_VALUE,
+			      "Closing connection from UID %d after the %s timeout",
+			      (int) conn->uid, deadline_names[conn->deadline_type]);
+
+	conn->expired = TRUE;
+	g_cancellable_cancel(conn->cancellable);
+}
+
+static void server_set_deadline(struct connection_info *conn,
+				enum connection_deadline type)
+{
+	static const gint *timeouts_ms[N_DEADLINES] = {
+		[DEADLINE_IDLE] = &idle_timeout_ms,
+		[DEADLINE_READ] = &read_timeout_ms,
+		[DEADLINE_WRITE] = &write_timeout_ms,
+	};
+
+	/* The time to read a command counts from its first part */
+	if (type == DEADLINE_READ && conn->deadline_type == DEADLINE_READ &&
+	    conn->deadline.pprev != NULL)
+		return;
+
+	conn->deadline_type = type;
+	if (*timeouts_ms[type] <= 0) {
+		timer_wheel_cancel(&conn->deadline);
+		return;
+	}
+
+	conn->deadline.callback = server_deadline_expired;
+	timer_wheel_arm(&conn->deadline, *timeouts_ms[type]);
+}
+
+/*
+ * Connections that are waiting for the counter to reach a value are kept in
+ * a min-heap of their alarms, so that a change of the counter only has to
+ * look at the earliest one. A tickless counter has no ticks to check the
+ * alarms on, so a timeout is set for the time that the earliest one is due.
+ */
+
+struct alarm {
+	int value;
+	struct connection_info *conn;
+};
+
+static struct alarm *alarms;
+static guint n_alarms;
+static guint alarms_size;
+static guint alarms_source_id;
+
+/* The connections whose alarms fired, in the order that they did */
+static struct connection_info *fired_alarms;
+static struct connection_info **fired_alarms_tail = &fired_alarms;
+static guint fired_alarms_source_id;
+
+/*
+ * The connections of the alarms that were passed on in the handoff. They are
+ * left alone until the process exits.
+ */
+static GPtrArray *handed_off_alarms;
+
+static void alarm_heap_set(guint i, struct alarm alarm)
+{
+	alarms[i] = alarm;
+	alarm.conn->alarm_index = i;
+}
+
+static void alarm_heap_sift_up(guint i)
+{
+	struct alarm alarm = alarms[i];
+
+	while (i > 0) {
+		guint parent = (i - 1) / 2;
+
+		if (alarms[parent].value <= alarm.value)
+			break;
+
+		alarm_heap_set(i, alarms[parent]);
+		i = parent;
+	}
+
+	alarm_heap_set(i, alarm);
+}
+
+static void alarm_heap_sift_down(guint i)
+{
+	struct alarm alarm = alarms[i];
+
+	for (;;) {
+		guint child = 2 * i + 1;
+
+		if (child >= n_alarms)
+			break;
+		if (child + 1 < n_alarms &&
+		    alarms[child + 1].value < alarms[child].value)
+			child++;
+		if (alarm.value <= alarms[child].value)
+			break;
+
+		alarm_heap_set(i, alarms[child]);
+		i = child;
+	}
+
+	alarm_heap_set(i, alarm);
+}
+
+static void alarm_add(struct connection_info *conn, int value)
+{
+	if (n_alarms == alarms_size) {
+		alarms_size = MAX(alarms_size * 2, 16);
+		alarms = g_renew(struct alarm, alarms, alarms_size);
+	}
+
+	conn->alarm_pending = TRUE;
+	alarms[n_alarms] = (struct alarm) { .value = value, .conn = conn };
+	alarm_heap_sift_up(n_alarms++);
+}
+
+static void alarm_remove(struct connection_info *conn)
+{
+	guint i = conn->alarm_index;
+	struct connection_info *moved;
+
+	conn->alarm_pending = FALSE;
+	if (--n_alarms == i)
+		return;
+
+	moved = alarms[n_alarms].conn;
+	alarm_heap_set(i, alarms[n_alarms]);
+	alarm_heap_sift_up(i);
+	alarm_heap_sift_down(moved->alarm_index);
+}
+
+static gboolean alarms_timeout_callback(gpointer data)
+{
+	struct counter_data *cntr = data;
+
+	alarms_source_id = 0;
+	alarms_check(cntr, counter_get(cntr));
+
+	return G_SOURCE_REMOVE;
+}
+
+static void alarms_schedule(struct counter_data *cntr)
+{
+	gint64 due_us, delay_us;
+
+	if (alarms_source_id != 0) {
+		clock_source_remove(alarms_source_id);
+		alarms_source_id = 0;
+	}
+
+	if (cntr->epoch_us == 0 || n_alarms == 0)
+		return;
+
+	/* The alarm is due once there have been value - base ticks */
+	due_us = cntr->epoch_us + ((gint64) alarms[0].value -
+				   g_atomic_int_get(&cntr->counter)) *
+				  cntr->period_us;
+	delay_us = MAX(due_us - clock_boottime_us(), 0);
+	alarms_source_id = clock_timeout_add((delay_us + 999) / 1000,
+					     alarms_timeout_callback, cntr);
+}
+
+static void alarm_unqueue(struct connection_info *conn)
+{
+	struct connection_info **link = &fired_alarms;
+
+	while (*link != conn)
+		link = &(*link)->next_fired;
+
+	*link = conn->next_fired;
+	if (fired_alarms_tail == &conn->next_fired)
+		fired_alarms_tail = link;
+	conn->alarm_queued = FALSE;
+}
+
+/*
+ * Lets the connections whose alarms fired carry on. Only the ones that were
+ * queued when the callback started are handled, the alarms that they fire in
+ * turn are left for the next one.
+ */
+static gboolean alarms_fired_callback(gpointer data)
+{
+	struct connection_info *fired = fired_alarms, *conn;
+
+	fired_alarms_source_id = 0;
+	fired_alarms = NULL;
+	fired_alarms_tail = &fired_alarms;
+
+	while ((conn = fired) != NULL) {
+		fired = conn->next_fired;
+		conn->alarm_queued = FALSE;
+		log_event_ratelimited(G_LOG_LEVEL_MESSAGE, "alarm",
+				      conn->alarm_counter,
+				      g_get_monotonic_time() - conn->command_start_us,
+				      "Alarm reached");
+		/* The reply is queued once the earlier ones are sent */
+		if (!conn->sending)
+			server_process_input(conn);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Fires the alarms that the counter has reached. This is called from within
+ * the commands that change the counter, so the connections are queued up to
+ * carry on from an idle callback instead of running their commands from
+ * within another connection's.
+ */
+static void alarms_check(struct counter_data *cntr, int counter)
+{
+	struct connection_info *conn;
+
+	while (n_alarms > 0 && alarms[0].value <= counter) {
+		conn = alarms[0].conn;
+		alarm_remove(conn);
+		conn->alarm_fired = TRUE;
+		conn->alarm_counter = counter;
+		conn->alarm_queued = TRUE;
+		conn->next_fired = NULL;
+		*fired_alarms_tail = conn;
+		fired_alarms_tail = &conn->next_fired;
+	}
+
+	alarms_schedule(cntr);
+
+	if (fired_alarms != NULL && fired_alarms_source_id == 0)
+		fired_alarms_source_id = g_idle_add(alarms_fired_callback, NULL);
+}
+
+/*
+ * Called on get_counter_and_terminate. The alarms are listed in the state,
+ * and their connections are passed to the successor once the state is sent.
+ * Commands that clients sent after an alarm aren't passed on.
+ */
+static void alarms_hand_off(GString *state)
+{
+	handed_off_alarms = g_ptr_array_sized_new(n_alarms);
+
+	for (guint i = 0; i < n_alarms; i++) {
+		g_string_append_printf(state, "alarm %d\n", alarms[i].value);
+		alarms[i].conn->alarm_pending = FALSE;
+		g_ptr_array_add(handed_off_alarms, alarms[i].conn);
+	}
+
+	n_alarms = 0;
+	if (alarms_source_id != 0) {
+		clock_source_remove(alarms_source_id);
+		alarms_source_id = 0;
+	}
+}
+
+#define ALARM_FDS_PER_MESSAGE 64
+
+/*
+ * The connections are sent after the state, with SCM_RIGHTS messages of up to
+ * ALARM_FDS_PER_MESSAGE connections each, in the order that the alarms are
+ * listed in. Every message has a single newline byte as data.
+ */
+static void server_pass_alarm_connections(struct connection_info *conn)
+{
+	GSocket *socket = g_socket_connection_get_socket(conn->connection);
+	static char newline[] = "\n";
+	guint n_conns;
+
+	if (handed_off_alarms == NULL)
+		return;
+
+	n_conns = handed_off_alarms->len;
+	for (guint i = 0; i < n_conns; i += ALARM_FDS_PER_MESSAGE) {
+		guint n_fds = MIN(n_conns - i, ALARM_FDS_PER_MESSAGE);
+		union {
+			struct cmsghdr cmsghdr;
+			char buf[CMSG_SPACE(sizeof(int) * ALARM_FDS_PER_MESSAGE)];
+		} control = { 0 };
+		struct iovec iov = { .iov_base = newline, .iov_len = 1 };
+		struct msghdr msghdr = { 0 };
+		struct cmsghdr *cmsg;
+
+		msghdr.msg_iov = &iov;
+		msghdr.msg_iovlen = 1;
+		msghdr.msg_control = &control;
+		msghdr.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+
+		cmsg = CMSG_FIRSTHDR(&msghdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+		for (guint j = 0; j < n_fds; j++) {
+			struct connection_info *alarm_conn = g_ptr_array_index(handed_off_alarms,
+									       i + j);
+			int fd = g_socket_get_fd(g_socket_connection_get_socket(alarm_conn->connection));
+
+			memcpy(CMSG_DATA(cmsg) + j * sizeof(int), &fd, sizeof(int));
+		}
+
+		while (sendmsg(g_socket_get_fd(socket), &msghdr, MSG_NOSIGNAL) < 0) {
+			if (errno == EAGAIN &&
+			    g_socket_condition_wait(socket, G_IO_OUT, NULL, NULL))
+				continue;
+			if (errno == EINTR)
+				continue;
+
+			g_warning("Error passing on the alarms: %s",
+				  g_strerror(errno));
+			return;
+		}
+	}
+
+	g_message("Passed on %u alarms", n_conns);
+}
+
+#ifdef EARLY_SERVICE_MAIN
+/* Closes the connections that the predecessor passed on without taking them */
+static void server_drop_alarms(void)
+{
+	if (handoff_alarm_fds == NULL)
+		return;
+
+	for (guint i = 0; i < handoff_alarm_fds->len; i++)
+		close(g_array_index(handoff_alarm_fds, int, i));
+
+	g_message("Closed %u alarm connections from the predecessor",
+		  handoff_alarm_fds->len);
+
+	g_array_unref(handoff_alarm_fds);
+	handoff_alarm_fds = NULL;
+}
+
+/* Takes over the connections of the alarms that the predecessor passed on */
+static void server_adopt_alarms(struct counter_data *cntr)
+{
+	GSocketConnection *connection;
+	struct connection_info *conn;
+	GError *error = NULL;
+	GSocket *socket;
+	guint n_adopted = 0;
+	uid_t uid;
+
+	if (handoff_alarm_fds == NULL)
+		return;
+
+	for (guint i = 0; i < handoff_alarm_fds->len; i++) {
+		int fd = g_array_index(handoff_alarm_fds, int, i);
+
+		if (i >= handoff_alarm_values->len) {
+			close(fd);
+			continue;
+		}
+
+		socket = g_socket_new_from_fd(fd, &error);
+		if (socket == NULL) {
+			g_warning("Error using alarm connection: %s",
+				  error->message);
+			g_clear_error(&error);
+			close(fd);
+			continue;
+		}
+
+		connection = g_socket_connection_factory_create_connection(socket);
+		g_object_unref(socket);
+
+		uid = get_peer_uid(connection);
+		if (!admit_connection(connection, uid)) {
+			g_object_unref(connection);
+			continue;
+		}
+
+		conn = connection_pool_get();
+		if (conn == NULL) {
+			release_connection(uid);
+			g_object_unref(connection);
+			continue;
+		}
+
+		conn->connection = connection;
+		conn->cntr = cntr;
+		conn->uid = uid;
+		conn->command = "alarm";
+		conn->command_start_us = g_get_monotonic_time();
+		alarm_add(conn, g_array_index(handoff_alarm_values, int, i));
+		n_adopted++;
+	}
+
+	g_message("Took over %u of %u alarms from the predecessor", n_adopted,
+		  handoff_alarm_values->len);
+
+	g_array_unref(handoff_alarm_fds);
+	handoff_alarm_fds = NULL;
+
+	/* Some of them may be due already */
+	alarms_check(cntr, counter_get(cntr));
+}
+#endif
+
+/*
+ * Replies are queued up while there are complete commands in the input
+ * buffer, and then sent with a single vectored write. Segments refer either
+ * to a range of conn->reply, or to a buffer that stays valid until the write
+ * is done. Once SERVER_OUTPUT_HIGH_WATER bytes are queued, the commands that
+ * follow wait until the queue has been written.
+ */
+
+static void server_reset_output(struct connection_info *conn)
+{
+	for (guint i = 0; i < conn->n_out_segments; i++) {
+		if (conn->out_segments[i].cache_entry != NULL)
+			reply_cache_put(conn->out_segments[i].cache_entry);
+	}
+
+	g_string_truncate(conn->reply, 0);
+	conn->n_out_segments = 0;
+	conn->out_bytes = 0;
+	conn->out_sent = 0;
+	conn->n_queued_commands = 0;
+}
+
+static void server_queue_segment(struct connection_info *conn,
+				 const char *data, gsize offset, gsize size)
+{
+	struct output_segment *last;
+
+	if (size == 0)
+		return;
+
+	conn->out_bytes += size;
+
+	/* Consecutive replies in conn->reply are sent as one segment */
+	if (conn->n_out_segments > 0 && data == NULL) {
+		last = &conn->out_segments[conn->n_out_segments - 1];
+		if (last->data == NULL && last->offset + last->size == offset) {
+			last->size += size;
+			return;
+		}
+	}
+
+	conn->out_segments[conn->n_out_segments++] = (struct output_segment) {
+		.data = data, .offset = offset, .size = size,
+	};
+}
+
+/* Queues a cached reply, and takes over the reference to it */
+static void server_queue_cached_reply(struct connection_info *conn,
+				      struct reply_cache_entry *entry)
+{
+	server_queue_segment(conn, entry->text, 0, entry->len);
+	conn->out_segments[conn->n_out_segments - 1].cache_entry = entry;
+}
+
+static gboolean server_output_full(struct connection_info *conn)
+{
+	return conn->out_bytes >= SERVER_OUTPUT_HIGH_WATER ||
+	       conn->n_out_segments + 2 > SERVER_MAX_OUTPUT_SEGMENTS;
+}
+
+void server_send_message(struct connection_info *conn);
+
+void server_message_sent(GObject *source_object, GAsyncResult *res,
+			 gpointer user_data)
+{
+	struct connection_info *conn = user_data;
+	GError *error = NULL;
+
+	conn->sending = FALSE;
+	g_output_stream_writev_all_finish(G_OUTPUT_STREAM(source_object), res,
+					  NULL, &error);
+	if (error != NULL) {
+		if (!conn->expired)
+			g_warning("%s", error->message);
+		g_error_free(error);
+		server_free_connection(conn);
+		return;
+	}
+
+	conn->out_sent += conn->out_sending;
+	if (conn->out_sent < conn->out_bytes) {
+		server_send_message(conn);
+		return;
+	}
+
+	/* Not at debug level, which is dropped by default, to log the latency */
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command, LOG_NO_VALUE,
+			      g_get_monotonic_time() - conn->command_start_us,
+			      "Replied to %u commands, the last one %s",
+			      conn->n_queued_commands, conn->command);
+
+	server_reset_output(conn);
+
+	if (conn->terminate_at_end)
+		server_pass_alarm_connections(conn);
+
+	if (conn->terminate_at_end || conn->close_at_end) {
+		server_free_connection(conn);
+		return;
+	}
+
+	/* Carry on with the next command that the client sent */
+	server_process_input(conn);
+}
+
+/*
+ * With SOCK_SEQPACKET, every write is a record, which can't be larger than
+ * the send buffer of the socket. Larger output, such as a long history or a
+ * handoff, is sent as several records of up to SERVER_SEQPACKET_MAX_RECORD
+ * bytes, one after the other.
+ */
+void server_send_message(struct connection_info *conn)
+{
+	gsize limit = use_seqpacket ? SERVER_SEQPACKET_MAX_RECORD : G_MAXSIZE;
+	gsize skip = conn->out_sent;
+	guint n_vectors = 0;
+
+	conn->out_sending = 0;
+	for (guint i = 0; i < conn->n_out_segments &&
+	     conn->out_sending < limit; i++) {
+		struct output_segment *segment = &conn->out_segments[i];
+		const char *data = segment->data != NULL ?
+			segment->data : conn->reply->str + segment->offset;
+		gsize size = segment->size;
+
+		if (skip >= size) {
+			skip -= size;
+			continue;
+		}
+
+		data += skip;
+		size = MIN(size - skip, limit - conn->out_sending);
+		skip = 0;
+
+		conn->out_vectors[n_vectors].buffer = data;
+		conn->out_vectors[n_vectors].size = size;
+		conn->out_sending += size;
+		n_vectors++;
+	}
+
+	server_set_deadline(conn, DEADLINE_WRITE);
+	conn->sending = TRUE;
+	g_output_stream_writev_all_async(g_io_stream_get_output_stream(G_IO_STREAM(conn->connection)),
+					 conn->out_vectors, n_vectors,
+					 G_PRIORITY_DEFAULT, conn->cancellable,
+					 server_message_sent, conn);
+}
+
+/*
+ * The commands are listed in commands.txt, which is turned into the
+ * server_dispatch_command() dispatch table at build time. It parses the
+ * arguments with the functions below, and calls server_command_<name>() for
+ * the command. The handlers append the reply to conn->reply, or return FALSE
+ * when the connection should be closed without a reply.
+ */
+
+/* Parses the next space separated integer argument of a command */
+static gboolean command_parse_int64(char **pos, gint64 *value)
+{
+	char *end;
+
+	while (**pos == ' ')
+		(*pos)++;
+
+	errno = 0;
+	*value = g_ascii_strtoll(*pos, &end, 10);
+	if (end == *pos || errno != 0 || (*end != ' ' && *end != '\0'))
+		return FALSE;
+
+	*pos = end;
+	return TRUE;
+}
+
+static gboolean command_parse_int(char **pos, int *value)
+{
+	gint64 value64;
+
+	if (!command_parse_int64(pos, &value64) ||
+	    value64 < G_MININT || value64 > G_MAXINT)
+		return FALSE;
+
+	*value = value64;
+	return TRUE;
+}
+
+/* Takes the remainder of the command as an argument */
+static gboolean command_parse_rest(char **pos, char **value)
+{
+	while (**pos == ' ')
+		(*pos)++;
+
+	*value = *pos;
+	*pos += strlen(*pos);
+	return TRUE;
+}
+
+/* Checks that there are no arguments left */
+static gboolean command_parse_end(char **pos)
+{
+	while (**pos == ' ')
+		(*pos)++;
+
+	return **pos == '\0';
+}
+
+static gboolean server_command_invalid(struct connection_info *conn)
+{
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command, LOG_NO_VALUE,
+			      LOG_NO_VALUE, "Invalid arguments for %s from client",
+			      conn->command);
+
+	g_string_append(conn->reply, "error invalid arguments\n");
+	return TRUE;
+}
+
+static gboolean server_command_unknown(struct connection_info *conn,
+				       char *command)
+{
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, NULL, LOG_NO_VALUE,
+			      LOG_NO_VALUE,
+			      "Unknown message '%s' from client", command);
+	return FALSE;
+}
+
+#include "commands.h"
+
+static gboolean server_command_get_counter(struct connection_info *conn)
+{
+	int counter = counter_get(conn->cntr);
+	struct reply_cache_entry *entry;
+
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command,
+			      counter, LOG_NO_VALUE,
+			      "Returning counter to client");
+
+	entry = reply_cache_get(counter);
+	if (entry == NULL)
+		entry = reply_cache_publish(counter);
+	if (entry != NULL) {
+		server_queue_cached_reply(conn, entry);
+		return TRUE;
+	}
+
+	g_string_append_printf(conn->reply, "%d\n", counter);
+	return TRUE;
+}
+
+/*
+ * Our pid lets the successor wait for us to exit, in case the listening
+ * socket was set up by an earlier process, whose pid SO_PEERCRED returns.
+ */
+static void server_hand_off(struct connection_info *conn)
+{
+	conn->terminate_at_end = TRUE;
+	g_string_append_printf(conn->reply, "pid %d\n", getpid());
+	alarms_hand_off(conn->reply);
+}
+
+static gboolean server_command_get_counter_and_terminate(struct connection_info *conn)
+{
+	log_event(G_LOG_LEVEL_MESSAGE, conn->command,
+		  counter_get(conn->cntr), LOG_NO_VALUE,
+		  "Returning counter to client %d and terminating the process",
+		  get_peer_pid(conn->connection));
+
+	gsize start = conn->reply->len;
+
+	format_state(conn->cntr, conn->reply);
+	server_hand_off(conn);
+	append_state_checksum(conn->reply, start);
+	return TRUE;
+}
+
+/*
+ * A successor that migrates the state in rounds first takes a snapshot and
+ * then the samples that were added since the previous round, while we keep
+ * serving clients. Only the last, small, delta is sent after we stop. Each
+ * reply ends with the sequence number to ask for next, the checksum of the
+ * reply from start on, and an end line, as the connection stays open.
+ */
+static void end_migration_reply(struct connection_info *conn, gsize start)
+{
+	g_string_append_printf(conn->reply, "sequence %" G_GUINT64_FORMAT "\n",
+			       conn->cntr->history.added);
+	append_state_checksum(conn->reply, start);
+	g_string_append(conn->reply, "end\n");
+}
+
+static gboolean server_command_migrate_snapshot(struct connection_info *conn)
+{
+	log_event(G_LOG_LEVEL_INFO, conn->command, counter_get(conn->cntr),
+		  LOG_NO_VALUE, "Sending a snapshot of the state to a successor");
+
+	gsize start = conn->reply->len;
+
+	format_state_since(conn->cntr, 0, conn->reply);
+	end_migration_reply(conn, start);
+	return TRUE;
+}
+
+static gboolean server_command_migrate_delta(struct connection_info *conn,
+					     gint64 since)
+{
+	gsize start = conn->reply->len;
+
+	if (since < 0)
+		return server_command_invalid(conn);
+
+	format_state_since(conn->cntr, since, conn->reply);
+	end_migration_reply(conn, start);
+	return TRUE;
+}
+
+static gboolean server_command_migrate_finish(struct connection_info *conn,
+					      gint64 since)
+{
+	gsize start = conn->reply->len;
+
+	if (since < 0)
+		return server_command_invalid(conn);
+
+	log_event(G_LOG_LEVEL_MESSAGE, conn->command,
+		  counter_get(conn->cntr), LOG_NO_VALUE,
+		  "Returning the rest of the state to client %d and terminating the process",
+		  get_peer_pid(conn->connection));
+
+	format_state_since(conn->cntr, since, conn->reply);
+	server_hand_off(conn);
+	end_migration_reply(conn, start);
+	return TRUE;
+}
+
+static gboolean server_command_set_counter(struct connection_info *conn,
+					   int new_counter)
+{
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command,
+			      new_counter, LOG_NO_VALUE,
+			      "Setting the counter to %d", new_counter);
+
+	g_string_append_printf(conn->reply, "previous value %d\n",
+			       counter_set(conn->cntr, new_counter));
+	return TRUE;
+}
+
+static gboolean server_command_add_counter(struct connection_info *conn,
+					   int delta)
+{
+	int counter = counter_add(conn->cntr, delta);
+
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command, counter,
+			      LOG_NO_VALUE, "Adding %d to the counter", delta);
+
+	g_string_append_printf(conn->reply, "%d\n", counter);
+	return TRUE;
+}
+
+static gboolean server_command_cas_counter(struct connection_info *conn,
+					   int expected, int new_counter)
+{
+	int prev = counter_cas(conn->cntr, expected, new_counter);
+
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command, prev,
+			      LOG_NO_VALUE, "Setting the counter to %d if it's %d: %s",
+			      new_counter, expected,
+			      prev == expected ? "done" : "not done");
+
+	g_string_append_printf(conn->reply, "previous value %d\n", prev);
+	return TRUE;
+}
+
+static gboolean server_command_get_and_reset(struct connection_info *conn)
+{
+	int prev = counter_set(conn->cntr, 0);
+
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command, prev,
+			      LOG_NO_VALUE, "Resetting the counter");
+
+	g_string_append_printf(conn->reply, "previous value %d\n", prev);
+	return TRUE;
+}
+
+/*
+ * Runs a list of operations on the counter, separated by ';', in one go:
+ *
+ *   get            returns the value
+ *   set VALUE      sets the value and returns the previous one
+ *   add DELTA      adds to the value and returns the new one
+ *   cas OLD NEW    sets the value if it's OLD and returns the previous one
+ *
+ * The results are returned on a single line, separated by spaces. All of the
+ * operations are parsed before any of them runs, so a malformed batch has no
+ * effect. The timer runs from the same main loop, so it can't tick in the
+ * middle of a batch. Each operation is atomic on its own, but the batch as a
+ * whole relies on this.
+ */
+
+#define BATCH_MAX_OPERATIONS 32
+
+enum batch_operation_type {
+	BATCH_GET,
+	BATCH_SET,
+	BATCH_ADD,
+	BATCH_CAS,
+};
+
+struct batch_operation {
+	enum batch_operation_type type;
+	int args[2];
+};
+
+static gboolean parse_batch_operation(char *op, struct batch_operation *batch_op)
+{
+	static const struct {
+		const char *name;
+		enum batch_operation_type type;
+		guint n_args;
+	} types[] = {
+		{ "get", BATCH_GET, 0 },
+		{ "set", BATCH_SET, 1 },
+		{ "add", BATCH_ADD, 1 },
+		{ "cas", BATCH_CAS, 2 },
+	};
+
+	while (*op == ' ')
+		op++;
+
+	for (guint i = 0; i < G_N_ELEMENTS(types); i++) {
+		if (strncmp(op, types[i].name, 3) != 0 ||
+		    (op[3] != ' ' && op[3] != '\0'))
+			continue;
+
+		op += 3;
+		batch_op->type = types[i].type;
+		for (guint arg = 0; arg < types[i].n_args; arg++) {
+			if (!command_parse_int(&op, &batch_op->args[arg]))
+				return FALSE;
+		}
+
+		return command_parse_end(&op);
+	}
+
+	return FALSE;
+}
+
+static gboolean server_command_batch(struct connection_info *conn,
+				     char *operations)
+{
+	struct batch_operation ops[BATCH_MAX_OPERATIONS];
+	guint n_ops = 0;
+	char *op, *next;
+	int result;
+
+	for (op = operations; op != NULL; op = next) {
+		next = strchr(op, ';');
+		if (next != NULL)
+			*next++ = '\0';
+
+		if (n_ops == G_N_ELEMENTS(ops) ||
+		    !parse_batch_operation(op, &ops[n_ops++]))
+			return server_command_invalid(conn);
+	}
+
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command, LOG_NO_VALUE,
+			      LOG_NO_VALUE, "Running a batch of %u operations",
+			      n_ops);
+
+	for (guint i = 0; i < n_ops; i++) {
+		switch (ops[i].type) {
+		case BATCH_GET:
+			result = counter_get(conn->cntr);
+			break;
+		case BATCH_SET:
+			result = counter_set(conn->cntr, ops[i].args[0]);
+			break;
+		case BATCH_ADD:
+			result = counter_add(conn->cntr, ops[i].args[0]);
+			break;
+		case BATCH_CAS:
+			result = counter_cas(conn->cntr, ops[i].args[0],
+					     ops[i].args[1]);
+			break;
+		default:
+			g_assert_not_reached();
+		}
+
+		g_string_append_printf(conn->reply, i == 0 ? "%d" : " %d", result);
+	}
+	g_string_append_c(conn->reply, '\n');
+
+	return TRUE;
+}
+
+static gboolean server_command_alarm(struct connection_info *conn, int value)
+{
+	int counter = counter_get(conn->cntr);
+
+	if (counter >= value) {
+		g_string_append_printf(conn->reply, "%d\n", counter);
+		return TRUE;
+	}
+
+	log_event_ratelimited(G_LOG_LEVEL_MESSAGE, conn->command, counter,
+			      LOG_NO_VALUE, "Waiting for the counter to reach %d",
+			      value);
+
+	alarm_add(conn, value);
+	alarms_schedule(conn->cntr);
+	return TRUE;
+}
+
+static gboolean server_command_advance_clock(struct connection_info *conn,
+					     gint64 delta_ms)
+{
+	if (!virtual_clock || delta_ms < 0 || delta_ms > G_MAXINT64 / 1000)
+		return server_command_invalid(conn);
+
+	log_event_ratelimited(G_LOG_LEVEL_DEBUG, conn->command, LOG_NO_VALUE,
+			      LOG_NO_VALUE, "Advancing the clock by %" G_GINT64_FORMAT " ms",
+			      delta_ms);
+
+	/* Otherwise our own deadline could expire while we're running */
+	timer_wheel_cancel(&conn->deadline);
+	virtual_clock_advance(delta_ms * 1000);
+
+	g_string_append_printf(conn->reply, "%" G_GINT64_FORMAT "\n",
+			       virtual_now_us);
+	return TRUE;
+}
+
+static gboolean server_command_expired_connections(struct connection_info *conn)
+{
+	for (guint i = 0; i < N_DEADLINES; i++)
+		g_string_append_printf(conn->reply, i == 0 ? "%s %u" : " %s %u",
+				       deadline_names[i],
+				       expired_connections[i]);
+	g_string_append_c(conn->reply, '\n');
+
+	return TRUE;
+}
+
+static gboolean server_command_history(struct connection_info *conn,
+				       gint64 from_us, gint64 to_us)
+{
+	format_history(&conn->cntr->history, from_us, to_us, conn->reply);
+	return TRUE;
+}
+
+void server_message_ready(GObject *source_object, GAsyncResult *res,
+			  gpointer user_data)
+{
+	GInputStream *istream = G_INPUT_STREAM(source_object);
+	struct connection_info *conn = user_data;
+	GError *error = NULL;
+	gssize bytes_read;
+
+	bytes_read = g_input_stream_read_finish(istream, res, &error);
+	if (error != NULL) {
+		if (!conn->expired)
+			g_warning("%s", error->message);
+		g_error_free(error);
+		server_free_connection(conn);
+		return;
+	}
+
+	if (bytes_read == 0)
+		conn->eof = TRUE;
+
+	/*
+	 * A packet that is longer than the buffer is truncated, so one that
+	 * fills it up is rejected without knowing whether it was complete.
+	 */
+	if (use_seqpacket && bytes_read == sizeof(conn->in_buf) - 1) {
+		g_message("Command from client is too long, ignoring it");
+		g_string_append(conn->reply, "error command too long\n");
+		server_queue_segment(conn, NULL, 0, conn->reply->len);
+		server_send_message(conn);
+		return;
+	}
+
+	conn->in_end += bytes_read;
+	server_process_input(conn);
+}
+
+static void server_read_input(struct connection_info *conn)
+{
+	/*
+	 * Commands are parsed in place, so a command that was only partially
+	 * read is moved to the front of the buffer to make room for the rest.
+	 */
+	if (conn->in_start > 0) {
+		memmove(conn->in_buf, conn->in_buf + conn->in_start,
+			conn->in_end - conn->in_start);
+		conn->in_end -= conn->in_start;
+		conn->in_start = 0;
+	}
+
+	/* One byte is always kept free to terminate the last command at EOF */
+	if (conn->in_end == sizeof(conn->in_buf) - 1) {
+		/* The command doesn't fit; drop it up to the next newline */
+		conn->in_end = 0;
+		if (!conn->discarding) {
+			g_message("Command from client is too long, ignoring it");
+			conn->discarding = TRUE;
+			/* Nothing else is queued when more input is read */
+			g_string_append(conn->reply, "error command too long\n");
+			server_queue_segment(conn, NULL, 0, conn->reply->len);
+			server_send_message(conn);
+			return;
+		}
+	}
+
+	server_set_deadline(conn, conn->in_end > 0 ? DEADLINE_READ :
+						     DEADLINE_IDLE);
+	g_input_stream_read_async(g_io_stream_get_input_stream(G_IO_STREAM(conn->connection)),
+				  conn->in_buf + conn->in_end,
+				  sizeof(conn->in_buf) - 1 - conn->in_end,
+				  G_PRIORITY_DEFAULT, conn->cancellable,
+				  server_message_ready, conn);
+}
+
+/*
+ * Runs the complete commands in the input buffer, and sends their replies
+ * together once there are none left. A read can return any number of
+ * commands, including a partial one, so this is called again after the
+ * replies are sent, and reads more input when there's nothing left to do.
+ */
+static void server_process_input(struct connection_info *conn)
+{
+	char *start, *end, *newline;
+	gsize reply_len;
+
+	if (conn->alarm_fired) {
+		reply_len = conn->reply->len;
+		g_string_append_printf(conn->reply, "%d\n", conn->alarm_counter);
+		server_queue_segment(conn, NULL, reply_len,
+				     conn->reply->len - reply_len);
+		conn->alarm_fired = FALSE;
+	}
+
+	while (!server_output_full(conn) && !conn->terminate_at_end &&
+	       !conn->close_at_end && !conn->alarm_pending) {
+		start = conn->in_buf + conn->in_start;
+		end = conn->in_buf + conn->in_end;
+
+		/*
+		 * Every read returns a single packet, which is the whole
+		 * command. A trailing newline is allowed.
+		 */
+		if (use_seqpacket) {
+			if (start == end)
+				break;
+			newline = end[-1] == '\n' ? end - 1 : end;
+		} else {
+			newline = memchr(start, '\n', end - start);
+		}
+
+		/* The last command doesn't need to be terminated by a newline */
+		if (newline == NULL && conn->eof && start != end)
+			newline = end;
+
+		if (newline == NULL)
+			break;
+
+		*newline = '\0';
+		if (newline > start && newline[-1] == '\r')
+			newline[-1] = '\0';
+
+		conn->in_start = MIN(newline + 1, end) - conn->in_buf;
+
+		/* This is the tail of a command that was too long */
+		if (conn->discarding) {
+			conn->discarding = FALSE;
+			continue;
+		}
+
+		conn->command = "unknown";
+		if (conn->n_queued_commands++ == 0)
+			conn->command_start_us = g_get_monotonic_time();
+
+		reply_len = conn->reply->len;
+		if (!server_dispatch_command(conn, start)) {
+			conn->close_at_end = TRUE;
+			break;
+		}
+
+		server_queue_segment(conn, NULL, reply_len,
+				     conn->reply->len - reply_len);
+	}
+
+	if (conn->n_out_segments > 0) {
+		server_send_message(conn);
+		return;
+	}
+
+	/* Nothing more is read until the alarm fires */
+	if (conn->alarm_pending) {
+		timer_wheel_cancel(&conn->deadline);
+		return;
+	}
+
+	if (conn->eof || conn->close_at_end || conn->terminate_at_end) {
+		server_free_connection(conn);
+		return;
+	}
 
-	return G_SOURCE_CONTINUE;
+	server_read_input(conn);
 }
 
 /*
- * The next block of functions are for the server that's exposed on a UNIX
- * domain socket. This is all done with asynchronous IO so that nothing will
- * block the glib main loop.
+ * Like in systemd socket units, socket paths that start with '@' are in the
+ * abstract namespace. These have no file that needs to be created, renamed,
+ * chowned or removed, and disappear when the last socket is closed.
  */
-
-void server_free_connection(struct connection_info *conn)
+static gboolean socket_path_is_abstract(const char *path)
 {
-	gboolean terminate = conn->terminate_at_end;
+	return path[0] == '@';
+}
 
-	g_object_unref(G_SOCKET_CONNECTION(conn->connection));
-	g_free(conn);
+static GSocketAddress *unix_socket_address_new(const char *path)
+{
+	if (socket_path_is_abstract(path))
+		return g_unix_socket_address_new_with_type(path + 1, -1,
+							   G_UNIX_SOCKET_ADDRESS_ABSTRACT);
 
-	if (terminate)
-		g_main_loop_quit(loop);
+	return g_unix_socket_address_new(path);
 }
 
-void server_message_sent(GObject *source_object, GAsyncResult *res,
-			 gpointer user_data)
+static GSocketType unix_socket_type(void)
 {
-	server_free_connection(user_data);
+	return use_seqpacket ? G_SOCKET_TYPE_SEQPACKET : G_SOCKET_TYPE_STREAM;
 }
 
-void server_send_message(struct connection_info *conn)
+#ifdef EARLY_SERVICE_MAIN
+static gboolean server_incoming_connection(GSocketService *service,
+					   GSocketConnection *connection,
+					   GObject *source_object,
+					   gpointer user_data)
 {
-	g_output_stream_write_async(g_io_stream_get_output_stream(G_IO_STREAM(conn->connection)),
-				    conn->buf, strlen(conn->buf),
-				    G_PRIORITY_DEFAULT, NULL,
-				    server_message_sent, conn);
+	struct connection_info *conn;
+	uid_t uid = get_peer_uid(connection);
+
+	if (!admit_connection(connection, uid)) {
+		log_event_ratelimited(G_LOG_LEVEL_MESSAGE, NULL, LOG_NO_VALUE,
+				      LOG_NO_VALUE,
+				      "Too many connections, replied busy to UID %d",
+				      (int) uid);
+		return FALSE;
+	}
+
+	conn = connection_pool_get();
+	if (conn == NULL) {
+		/*
+		 * The service was already stopped, but a connection that was
+		 * accepted before that can still show up.
+		 */
+		g_message("No free connection slot, dropping the connection");
+		release_connection(uid);
+		return FALSE;
+	}
+
+	conn->connection = g_object_ref(connection);
+	conn->cntr = user_data;
+	conn->uid = uid;
+
+	server_read_input(conn);
+
+	return FALSE;
 }
 
-#define SERVER_SET_COUNTER_COMMAND "set_counter "
+/*
+ * The inode of the socket that we're listening on. A successor can take over
+ * the server socket path while we're still running, so this is used to only
+ * remove the socket at exit if it's still ours.
+ */
+static ino_t server_socket_ino;
 
-void server_message_ready(GObject *source_object, GAsyncResult *res,
-			  gpointer user_data)
+/*
+ * An abstract socket can't be renamed into place, so it can only be bound once
+ * the predecessor that we read the state from has closed it. Binding is
+ * retried until then, *in_use is set when the name is still taken.
+ */
+static gboolean bind_abstract_socket(GSocket *socket, char *server_socket_path,
+				     gboolean *in_use)
 {
-	GInputStream *istream = G_INPUT_STREAM(source_object);
-	struct connection_info *conn = user_data;
+	GSocketAddress *address;
 	GError *error = NULL;
-	int new_counter;
-	char *pos;
 
-	g_input_stream_read_finish(istream, res, &error);
-	if (error != NULL) {
-		g_printerr("%s", error->message);
+	address = unix_socket_address_new(server_socket_path);
+	if (!g_socket_bind(socket, address, FALSE, &error) ||
+	    !g_socket_listen(socket, &error)) {
+		*in_use = g_error_matches(error, G_IO_ERROR,
+					  G_IO_ERROR_ADDRESS_IN_USE);
+		if (!*in_use)
+			g_warning("Error binding socket: %s", error->message);
 		g_error_free(error);
-		return;
+		g_object_unref(address);
+		return FALSE;
 	}
 
-	if ((pos = strchr(conn->buf, '\n')) != NULL)
-		*pos = '\0';
+	g_object_unref(address);
 
-	if (g_str_equal(conn->buf, "get_counter")) {
-		g_message("Returning counter to client");
+	return TRUE;
+}
 
-		g_snprintf(conn->buf, sizeof(conn->buf),
-			   "%d\n", conn->cntr->counter);
-		server_send_message(conn);
-	} else if (g_str_equal(conn->buf, "get_counter_and_terminate")) {
-		g_message("Returning counter to client and terminating the process");
+static GSocket *bind_unix_domain_socket(char *server_socket_path,
+					gboolean *in_use)
+{
+	GSocketAddress *address;
+	GError *error = NULL;
+	GSocket *socket;
+	gchar *tmp_path;
 
-		conn->terminate_at_end = TRUE;
-		g_snprintf(conn->buf, sizeof(conn->buf),
-			   "%d\n", conn->cntr->counter);
-		server_send_message(conn);
-	} else if (g_str_has_prefix(conn->buf, SERVER_SET_COUNTER_COMMAND)) {
-		new_counter = g_ascii_strtoll(conn->buf + sizeof(SERVER_SET_COUNTER_COMMAND) - 1,
-					      NULL, 10);
+	socket = g_socket_new(G_SOCKET_FAMILY_UNIX, unix_socket_type(),
+			      G_SOCKET_PROTOCOL_DEFAULT, &error);
+	if (socket == NULL) {
+		g_warning("Error creating socket: %s", error->message);
+		g_error_free(error);
+		return NULL;
+	}
 
-		g_message("Setting the counter to %d", new_counter);
+	if (socket_path_is_abstract(server_socket_path)) {
+		g_socket_set_listen_backlog(socket, listen_backlog);
+		if (!bind_abstract_socket(socket, server_socket_path, in_use)) {
+			g_object_unref(socket);
+			return NULL;
+		}
+		return socket;
+	}
 
-		g_snprintf(conn->buf, sizeof(conn->buf),
-			   "previous value %d\n", conn->cntr->counter);
-		conn->cntr->counter = new_counter;
-		server_send_message(conn);
-	} else {
-		g_message("Unknown message '%s' from client", conn->buf);
-		server_free_connection(conn);
+	/*
+	 * Bind to a temporary path and atomically rename it into place. This
+	 * replaces a stale socket left behind by a previous generation, and
+	 * means that clients never see the path missing.
+	 */
+	tmp_path = g_strdup_printf("%s.%d.tmp", server_socket_path, getpid());
+	g_unlink(tmp_path);
+
+	g_socket_set_listen_backlog(socket, listen_backlog);
+
+	address = g_unix_socket_address_new(tmp_path);
+	if (!g_socket_bind(socket, address, TRUE, &error) ||
+	    !g_socket_listen(socket, &error)) {
+		g_warning("Error binding socket: %s", error->message);
+		g_error_free(error);
+		goto fail;
 	}
-}
 
-static gboolean server_incoming_connection(GSocketService *service,
-					   GSocketConnection *connection,
-					   GObject *source_object,
-					   gpointer user_data)
-{
-	struct connection_info *conn = g_new0(struct connection_info, 1);
+	if (g_rename(tmp_path, server_socket_path) != 0) {
+		g_warning("Error moving socket into place at %s: %s",
+			  server_socket_path, g_strerror(errno));
+		goto fail;
+	}
 
-	conn->connection = g_object_ref(connection);
-	conn->cntr = user_data;
+	g_object_unref(address);
+	g_free(tmp_path);
 
-	g_input_stream_read_async(g_io_stream_get_input_stream(G_IO_STREAM(connection)),
-				  conn->buf, sizeof(conn->buf),
-				  G_PRIORITY_DEFAULT, NULL,
-				  server_message_ready, conn);
+	return socket;
 
-	return FALSE;
+fail:
+	g_unlink(tmp_path);
+	g_object_unref(address);
+	g_object_unref(socket);
+	g_free(tmp_path);
+	return NULL;
 }
 
 static GSocketService *create_unix_domain_server(char *server_socket_path,
-						 struct counter_data *cntr)
+						 struct counter_data *cntr,
+						 gboolean *in_use)
 {
 	GSocketService *service;
-	GSocketAddress *address;
+	GSocket *socket = NULL;
 	GError *error = NULL;
+	GStatBuf st;
 
 	service = g_socket_service_new();
 	if (service == NULL) {
-		g_printerr("Error creating socket service.\n");
+		g_warning("Error creating socket service.");
 		return NULL;
 	}
 
-	address = g_unix_socket_address_new(server_socket_path);
-	if (address == NULL) {
-		g_printerr("Error creating socket address.\n");
-		g_object_unref(service);
-		return NULL;
+	if (listener_fd >= 0) {
+		g_message("Using listening socket from the file descriptor store");
+		socket = g_socket_new_from_fd(listener_fd, &error);
+		if (socket != NULL) {
+			/* Listening again updates the backlog */
+			g_socket_set_listen_backlog(socket, listen_backlog);
+			g_socket_listen(socket, NULL);
+		} else {
+			g_warning("Error using stored socket: %s",
+				  error->message);
+			g_clear_error(&error);
+			close(listener_fd);
+			listener_fd = -1;
+		}
+	}
+
+	if (listener_fd < 0) {
+		socket = bind_unix_domain_socket(server_socket_path, in_use);
+		if (socket == NULL) {
+			g_object_unref(service);
+			return NULL;
+		}
+
+		listener_fd = g_socket_get_fd(socket);
+		listener_stored = store_fd("listener", listener_fd);
 	}
 
-	if (!g_socket_listener_add_address(G_SOCKET_LISTENER(service),
-					   G_SOCKET_ADDRESS(address),
-					   G_SOCKET_TYPE_STREAM,
-					   G_SOCKET_PROTOCOL_DEFAULT,
-					   NULL, NULL, &error)) {
-		g_printerr("Error binding socket: %s\n", error->message);
+	if (!g_socket_listener_add_socket(G_SOCKET_LISTENER(service), socket,
+					  NULL, &error)) {
+		g_warning("Error listening on socket: %s", error->message);
 		g_error_free(error);
+		g_object_unref(socket);
 		g_object_unref(service);
-		g_object_unref(address);
 		return NULL;
 	}
 
+	g_object_unref(socket);
+
+	if (!socket_path_is_abstract(server_socket_path) &&
+	    g_stat(server_socket_path, &st) == 0)
+		server_socket_ino = st.st_ino;
+
 	g_signal_connect(service, "incoming",
 			 G_CALLBACK(server_incoming_connection), cntr);
 
@@ -186,6 +3688,18 @@ static GSocketService *create_unix_domain_server(char *server_socket_path,
 	return service;
 }
 
+static void remove_unix_domain_server(char *server_socket_path)
+{
+	GStatBuf st;
+
+	if (socket_path_is_abstract(server_socket_path))
+		return;
+
+	if (g_stat(server_socket_path, &st) == 0 && st.st_ino == server_socket_ino)
+		g_unlink(server_socket_path);
+}
+#endif
+
 /*
  * This is the client that reads the current state from another process
  * via a UNIX domain socket. This is done using synchronous IO since this
@@ -195,72 +3709,569 @@ static GSocketService *create_unix_domain_server(char *server_socket_path,
 
 #define CLIENT_GET_COUNTER_COMMAND "get_counter_and_terminate\n"
 
-int read_counter_from_server(gchar *server_path)
+#define CLIENT_READ_SIZE 4096
+
+/*
+ * A predecessor that has all its connections in use leaves ours in the listen
+ * backlog, so connecting and each wait for the state is bounded, after which
+ * the next source is tried.
+ */
+#define CLIENT_TIMEOUT_S 5
+
+static void close_fds(GArray *fds)
+{
+	for (guint i = 0; i < fds->len; i++)
+		close(g_array_index(fds, int, i));
+	g_array_set_size(fds, 0);
+}
+
+#define MIGRATION_END_LINE "\nend\n"
+#define MIGRATION_SEQUENCE_LINE "\nsequence "
+#define MIGRATION_FINAL_DELTA_SAMPLES 16
+
+/*
+ * Reads the state until the server closes the connection, along with the
+ * connections of the alarms that are passed on after it. With until_end, it
+ * stops at the end line of a migration reply instead, as the server keeps the
+ * connection open. With SOCK_SEQPACKET the state is sent in a single packet,
+ * which would be truncated when read into a smaller buffer, so the size of
+ * each packet is peeked at first.
+ */
+static gboolean receive_state(GSocketConnection *connection, GString *state,
+			      GArray *fds, gboolean until_end)
+{
+	GSocket *socket = g_socket_connection_get_socket(connection);
+	union {
+		struct cmsghdr cmsghdr;
+		char buf[CMSG_SPACE(sizeof(int) * ALARM_FDS_PER_MESSAGE)];
+	} control;
+	int sock = g_socket_get_fd(socket);
+	struct msghdr msghdr = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	GError *error = NULL;
+	ssize_t size;
+	gsize len;
+
+	do {
+		if (!g_socket_condition_wait(socket, G_IO_IN, NULL, &error)) {
+			g_warning("Error waiting for the state: %s",
+				  error->message);
+			g_error_free(error);
+			return FALSE;
+		}
+
+		size = CLIENT_READ_SIZE;
+		if (use_seqpacket)
+			size = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+		if (size < 0)
+			goto fail;
+
+		len = state->len;
+		g_string_set_size(state, len + size);
+		iov.iov_base = state->str + len;
+		iov.iov_len = size;
+		msghdr.msg_iov = &iov;
+		msghdr.msg_iovlen = 1;
+		msghdr.msg_control = &control;
+		msghdr.msg_controllen = sizeof(control);
+
+		size = recvmsg(sock, &msghdr, MSG_CMSG_CLOEXEC);
+		g_string_set_size(state, len + MAX(size, 0));
+		if (size < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			goto fail;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msghdr); cmsg != NULL;
+		     cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_RIGHTS)
+				g_array_append_vals(fds, CMSG_DATA(cmsg),
+						    (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		}
+	} while (size != 0 &&
+		 !(until_end && g_str_has_suffix(state->str, MIGRATION_END_LINE)));
+
+	return TRUE;
+
+fail:
+	g_warning("Error reading from socket: %s", g_strerror(errno));
+	return FALSE;
+}
+
+static GSocketConnection *connect_to_server(GSocketClient *client,
+					    const gchar *server_path)
 {
 	GSocketConnection *connection;
 	GSocketAddress *address;
-	GSocketClient *client;
 	GError *error = NULL;
-	gssize bytes_read;
-	gchar buf[100];
-
-	client = g_socket_client_new();
-	address = g_unix_socket_address_new(server_path);
 
+	address = unix_socket_address_new(server_path);
 	connection = g_socket_client_connect(client,
 					     G_SOCKET_CONNECTABLE(address),
 					     NULL, &error);
+	g_object_unref(address);
 	if (error != NULL) {
 		/*
 		 * We shouldn't terminate when we can't read the current state.
-		 * Just start over.
+		 * Just try the next source.
 		 */
-		g_printerr("Error connecting to socket: %s", error->message);
+		g_warning("Error connecting to socket: %s", error->message);
 		g_error_free(error);
-		return 0;
+		return NULL;
+	}
+
+	return connection;
+}
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * The pidfd of the server is opened before we ask it to terminate, so that
+ * it can't have exited and had its pid reused yet.
+ */
+static int open_peer_pidfd(GSocketConnection *connection, pid_t *pid)
+{
+	int sock = g_socket_get_fd(g_socket_connection_get_socket(connection));
+	socklen_t len = sizeof(struct ucred);
+	struct ucred ucred;
+	int pidfd;
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &ucred, &len) < 0) {
+		g_message("Can't get the pid of the predecessor: %s",
+			  g_strerror(errno));
+		return -1;
+	}
+
+	*pid = ucred.pid;
+	pidfd = open_pidfd(ucred.pid);
+	if (pidfd < 0)
+		g_message("Can't track predecessor %d: %s", ucred.pid,
+			  g_strerror(errno));
+
+	return pidfd;
+}
+
+/*
+ * When the listening socket was set up by an earlier process, SO_PEERCRED
+ * returns its pid rather than the one of the predecessor, which tells us
+ * its own pid in the state. It might have exited already by the time that
+ * we open it.
+ */
+static void track_predecessor(int pidfd, pid_t pid)
+{
+	if (handoff_pid > 0 && handoff_pid != pid) {
+		if (pidfd >= 0)
+			close(pidfd);
+		pid = handoff_pid;
+		pidfd = open_pidfd(pid);
+		if (pidfd < 0 && errno == ESRCH)
+			g_message("Predecessor %d exited before the handoff completed",
+				  pid);
 	}
 
-	GInputStream *input_stream = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+	state_received_us = g_get_monotonic_time();
+	predecessor_pidfd = pidfd;
+	predecessor_pid = pid;
+}
+
+static gboolean send_command(GSocketConnection *connection,
+			     const char *command)
+{
 	GOutputStream *output_stream = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+	GError *error = NULL;
 
-	g_output_stream_write(output_stream, CLIENT_GET_COUNTER_COMMAND,
-			      strlen(CLIENT_GET_COUNTER_COMMAND), NULL, &error);
+	g_output_stream_write_all(output_stream, command, strlen(command),
+				  NULL, NULL, &error);
 	if (error != NULL) {
-		g_printerr("Error writing to socket: %s", error->message);
+		g_warning("Error writing to socket: %s", error->message);
 		g_error_free(error);
-		return 0;
+		return FALSE;
 	}
 
-	bytes_read = g_input_stream_read(input_stream, buf, sizeof(buf) - 1,
-					 NULL, &error);
-	if (error != NULL) {
-		g_printerr("Error reading from socket: %s", error->message);
-		g_error_free(error);
-		return 0;
+	return TRUE;
+}
+
+/* Returns -1 when the reply isn't a complete migration reply */
+static gint64 migration_reply_sequence(GString *state)
+{
+	const char *line;
+
+	if (strstr(state->str, MIGRATION_END_LINE) == NULL)
+		return -1;
+
+	line = g_strrstr(state->str, MIGRATION_SEQUENCE_LINE);
+	if (line == NULL)
+		return -1;
+
+	return g_ascii_strtoll(line + strlen(MIGRATION_SEQUENCE_LINE), NULL, 10);
+}
+
+static gboolean request_migration_reply(GSocketConnection *connection,
+					const char *command, gint64 sequence,
+					GString *state, GArray *fds,
+					gboolean until_end)
+{
+	gchar *line = g_strdup_printf("%s %" G_GINT64_FORMAT "\n", command,
+				      sequence);
+	gboolean ret;
+
+	g_string_set_size(state, 0);
+	ret = send_command(connection, line) &&
+	      receive_state(connection, state, fds, until_end);
+	g_free(line);
+	return ret;
+}
+
+/*
+ * Copies the state while the predecessor keeps serving its clients: first a
+ * snapshot, then the history samples that were added during the previous
+ * round, until there are few enough of them left that the predecessor can
+ * be stopped to send the rest. That keeps the time during which neither of
+ * us serves clients independent of the size of the history. Sets
+ * unsupported when the predecessor is too old to know about this, in which
+ * case it closes the connection without a reply. The state is parsed into
+ * cntr as it comes in, so the caller passes a scratch copy.
+ */
+static gboolean migrate_state_from_server(GSocketConnection *connection,
+					  struct counter_data *cntr,
+					  GString *state, GArray *fds,
+					  gboolean *unsupported)
+{
+	gint64 sequence, next, start_us;
+	int round = 0;
+
+	*unsupported = FALSE;
+
+	if (!send_command(connection, "migrate_snapshot\n") ||
+	    !receive_state(connection, state, fds, TRUE))
+		return FALSE;
+
+	sequence = migration_reply_sequence(state);
+	if (sequence < 0) {
+		*unsupported = state->len == 0;
+		return FALSE;
 	}
 
-	buf[bytes_read] = '\0';
+	if (!parse_state(state->str, cntr))
+		return FALSE;
 
-	g_object_unref(connection);
+	while (round < migration_rounds) {
+		round++;
+		if (!request_migration_reply(connection, "migrate_delta",
+					     sequence, state, fds, TRUE))
+			return FALSE;
+
+		next = migration_reply_sequence(state);
+		if (next < 0 || !parse_state_delta(state->str, cntr))
+			return FALSE;
+
+		g_debug("Migration round %d copied %" G_GINT64_FORMAT
+			" history samples", round, next - sequence);
+
+		if (next - sequence <= MIGRATION_FINAL_DELTA_SAMPLES) {
+			sequence = next;
+			break;
+		}
+		sequence = next;
+	}
+
+	start_us = g_get_monotonic_time();
+	if (!request_migration_reply(connection, "migrate_finish", sequence,
+				     state, fds, FALSE))
+		return FALSE;
+
+	next = migration_reply_sequence(state);
+	if (next < 0 || !parse_state_delta(state->str, cntr))
+		return FALSE;
+
+	log_event(G_LOG_LEVEL_MESSAGE, "migrate_finish", LOG_NO_VALUE,
+		  g_get_monotonic_time() - start_us,
+		  "Migrated the state in %d rounds, the last %" G_GINT64_FORMAT
+		  " history samples while the predecessor was stopped",
+		  round, next - sequence);
+	return TRUE;
+}
+
+gboolean read_state_from_server(gchar *server_path, struct counter_data *cntr)
+{
+	GSocketConnection *connection;
+	gboolean unsupported;
+	GSocketClient *client;
+	gboolean ret = FALSE;
+	pid_t peer_pid = 0;
+	GString *state;
+	int peer_pidfd;
+	GArray *fds;
+
+	client = g_socket_client_new();
+	g_socket_client_set_socket_type(client, unix_socket_type());
+	g_socket_client_set_timeout(client, CLIENT_TIMEOUT_S);
+
+	connection = connect_to_server(client, server_path);
+	if (connection == NULL) {
+		g_object_unref(client);
+		return FALSE;
+	}
+
+	peer_pidfd = open_peer_pidfd(connection, &peer_pid);
+	state = g_string_new(NULL);
+	fds = g_array_new(FALSE, FALSE, sizeof(int));
+
+	/*
+	 * The predecessor keeps running until the migration is finished, so
+	 * when it fails part of the way, the state is read the old way instead.
+	 * A predecessor that did hand off closes the socket, and then there's
+	 * nothing left to connect to.
+	 */
+	if (migration_rounds > 0) {
+		struct counter_data migrated = { 0 };
+
+		history_init(&migrated.history, cntr->history.size);
+		ret = migrate_state_from_server(connection, &migrated, state,
+						fds, &unsupported);
+		if (ret) {
+			g_free(cntr->history.samples);
+			*cntr = migrated;
+		} else {
+			g_free(migrated.history.samples);
+			if (unsupported)
+				g_message("Predecessor can't migrate the state in rounds, stopping it right away");
+			else
+				g_message("Migrating the state from socket %s failed, stopping the predecessor right away",
+					  server_path);
+			close_fds(fds);
+			g_object_unref(connection);
+			connection = connect_to_server(client, server_path);
+			g_string_set_size(state, 0);
+		}
+	}
+
+	if (connection != NULL && !ret &&
+	    send_command(connection, CLIENT_GET_COUNTER_COMMAND) &&
+	    receive_state(connection, state, fds, FALSE))
+		ret = parse_state(state->str, cntr);
+
+	if (ret) {
+		handoff_alarm_fds = fds;
+		track_predecessor(peer_pidfd, peer_pid);
+	} else {
+		close_fds(fds);
+		g_array_unref(fds);
+		if (peer_pidfd >= 0)
+			close(peer_pidfd);
+	}
+
+	g_string_free(state, TRUE);
+	g_clear_object(&connection);
 	g_object_unref(client);
+	return ret;
+}
+
+static gboolean read_state_from_file(gchar *path, struct counter_data *cntr)
+{
+	GError *error = NULL;
+	gboolean ret;
+	gchar *buf;
+
+	if (!g_file_get_contents(path, &buf, NULL, &error)) {
+		g_message("Not reading state from %s: %s", path, error->message);
+		g_error_free(error);
+		return FALSE;
+	}
 
-	return g_ascii_strtoll(buf, NULL, 10);
+	ret = parse_state(buf, cntr);
+	g_free(buf);
+
+	/* The state is only valid for the generation that follows */
+	g_unlink(path);
+
+	return ret;
 }
 
-int get_initial_counter(void)
+#ifdef EARLY_SERVICE_MAIN
+static void save_state_to_file(gchar *path, struct counter_data *cntr)
 {
-	if (client_socket_path == NULL)
-		return 0;
+	GString *state = g_string_new(NULL);
+	GError *error = NULL;
+
+	format_state(cntr, state);
+	append_state_checksum(state, 0);
+
+	if (!g_file_set_contents(path, state->str, state->len, &error)) {
+		g_warning("Error saving state to %s: %s", path,
+			  error->message);
+		g_error_free(error);
+		g_string_free(state, TRUE);
+		return;
+	}
+
+	g_string_free(state, TRUE);
+
+	g_message("Saved state to %s", path);
+}
+#endif
+
+/*
+ * The unit lists its own socket as a source, for the case where a running
+ * predecessor has it. When systemd gave the listening socket back to us, it
+ * can only be our own, and reading from it would block forever, since
+ * nothing serves it until we have the state.
+ */
+static gboolean is_restored_listener(const char *path)
+{
+	struct sockaddr_un sa;
+	socklen_t len = sizeof(sa);
+	gsize path_len;
+	char *a, *b;
+	gboolean ret;
+
+	if (listener_fd < 0 ||
+	    getsockname(listener_fd, (struct sockaddr *) &sa, &len) < 0 ||
+	    len <= G_STRUCT_OFFSET(struct sockaddr_un, sun_path))
+		return FALSE;
+
+	path_len = len - G_STRUCT_OFFSET(struct sockaddr_un, sun_path);
+	if (socket_path_is_abstract(path))
+		return sa.sun_path[0] == '\0' && path_len - 1 == strlen(path + 1) &&
+		       memcmp(sa.sun_path + 1, path + 1, path_len - 1) == 0;
+
+	if (sa.sun_path[0] == '\0')
+		return FALSE;
+
+	sa.sun_path[MIN(path_len, sizeof(sa.sun_path) - 1)] = '\0';
+	a = realpath(path, NULL);
+	b = realpath(sa.sun_path, NULL);
+	ret = g_str_equal(a ? a : path, b ? b : sa.sun_path);
+	free(a);
+	free(b);
+
+	return ret;
+}
+
+void get_initial_state(struct counter_data *cntr)
+{
+	history_init(&cntr->history, MAX(history_size, 0));
+
+	/*
+	 * The file descriptor store is only passed to us when a previous
+	 * instance of this service crashed or was restarted, and it's kept
+	 * up to date on every tick. A running predecessor always has the most
+	 * recent state. The state file is only written by a predecessor that
+	 * was stopped.
+	 */
+	if (read_state_from_fd_store(cntr)) {
+		g_message("Read starting position from the file descriptor store");
+		goto found;
+	}
+
+	for (gchar **path = client_socket_paths; path != NULL && *path != NULL; path++) {
+		if (is_restored_listener(*path)) {
+			g_message("Not reading starting position from socket %s, it's our own",
+				  *path);
+			continue;
+		}
+
+		g_message("Reading starting position from socket %s", *path);
+		if (read_state_from_server(*path, cntr))
+			goto found;
+	}
+
+	if (state_file_path != NULL && read_state_from_file(state_file_path, cntr))
+		goto found;
+
+	if (state_corrupted)
+		g_warning("All the states that were found were corrupted, starting from 0");
+
+	cntr->counter = 0;
+	cntr->generation = 0;
+	cntr->epoch_us = 0;
+	cntr->history.start = 0;
+	cntr->history.count = 0;
+	return;
 
-	g_message("Reading starting position from socket %s",
-		  client_socket_path);
+found:
+	cntr->generation++;
+}
+
+#define SERVER_BIND_RETRY_MS 10
+#define SERVER_BIND_ATTEMPTS 500
+
+#ifdef EARLY_SERVICE_MAIN
+static gboolean start_server_callback(gpointer data)
+{
+	struct counter_data *cntr = data;
+	static guint attempts;
+	gboolean in_use = FALSE;
+
+	if (server_socket_path == NULL) {
+		g_message("Not listening on a UNIX socket.");
+		server_drop_alarms();
+		return G_SOURCE_REMOVE;
+	}
+
+	if (attempts++ == 0) {
+		g_message("Listening on UNIX socket %s", server_socket_path);
+		if (!connection_pool_init())
+			goto fail;
+	}
+
+	service = create_unix_domain_server(server_socket_path, cntr, &in_use);
+	if (service == NULL) {
+		/* The predecessor still has the abstract socket open */
+		if (in_use && attempts < SERVER_BIND_ATTEMPTS) {
+			if (attempts == 1)
+				g_message("Socket %s is in use, waiting for it to be closed",
+					  server_socket_path);
+			g_timeout_add(SERVER_BIND_RETRY_MS,
+				      start_server_callback, cntr);
+			return G_SOURCE_REMOVE;
+		}
+		if (in_use)
+			g_warning("Socket %s is still in use, giving up",
+				  server_socket_path);
+		goto fail;
+	}
+
+	trace_startup_step("listening");
+
+	server_adopt_alarms(cntr);
 
-	return read_counter_from_server(client_socket_path);
+	return G_SOURCE_REMOVE;
+
+fail:
+	server_drop_alarms();
+	exit_status = 1;
+	g_main_loop_quit(loop);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean terminate_signal_callback(gpointer data)
+{
+	g_message("Received termination signal");
+	g_main_loop_quit(loop);
+
+	return G_SOURCE_REMOVE;
 }
+#endif
 
+#if defined(EARLY_SERVICE_BENCHMARK)
+#include "benchmark.c"
+#elif defined(EARLY_SERVICE_STATE_LAYOUT_TEST)
+#include "state-layout-test.c"
+#else
 int main(int argc, char **argv)
 {
-	GSocketService *service = NULL;
 	GOptionContext *context;
 	GError *error = NULL;
 
@@ -271,6 +4282,14 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if ((tickless || virtual_clock) && timer_delay_ms <= 0) {
+		g_printerr("The timer delay must be positive in tickless and virtual clock mode\n");
+		return 1;
+	}
+
+	log_init();
+	startup_trace_init();
+
 	if (survive_systemd_kill_signal) {
 		/*
 		 * See https://systemd.io/ROOT_STORAGE_DAEMONS/ for more details
@@ -284,29 +4303,51 @@ int main(int argc, char **argv)
 
 	loop = g_main_loop_new(NULL, FALSE);
 
-	struct counter_data cntr = {
-		.counter = get_initial_counter()
-	};
+	struct counter_data cntr = { 0 };
 
-	guint timer_id = g_timeout_add(timer_delay_ms, timer_callback, &cntr);
+	restore_fd_store();
+	get_initial_state(&cntr);
+	counter_clock_init(&cntr);
+	g_message("Starting generation %u at counter %d", cntr.generation,
+		  counter_get(&cntr));
+	trace_startup_step("state read");
 
-	if (server_socket_path != NULL) {
-		g_message("Listening on UNIX socket %s", server_socket_path);
-		service = create_unix_domain_server(server_socket_path, &cntr);
-		if (service == NULL)
-			return 1;
-	} else
-		g_message("Not listening on a UNIX socket.");
+	create_state_store();
+	store_state(&cntr);
+
+	/*
+	 * The first tick happens right away. The socket service, and with it
+	 * most of the GObject type system, is only set up once the main loop
+	 * is running, so it doesn't delay the first tick. A tickless counter
+	 * doesn't need a timer at all. After a handoff, ticking starts when
+	 * the predecessor is gone.
+	 */
+	if (predecessor_pidfd >= 0)
+		wait_for_predecessor(&cntr);
+	else if (!tickless)
+		start_ticking(&cntr);
+	g_idle_add(start_server_callback, &cntr);
+
+	g_unix_signal_add(SIGTERM, terminate_signal_callback, NULL);
+	g_unix_signal_add(SIGINT, terminate_signal_callback, NULL);
 
 	g_main_loop_run(loop);
 
-	g_source_remove(timer_id);
+	if (tick_source_id != 0)
+		clock_source_remove(tick_source_id);
 	if (service != NULL) {
 		g_socket_service_stop(service);
-		g_unlink(server_socket_path);
+		/* The next instance reuses the stored socket */
+		if (!listener_stored)
+			remove_unix_domain_server(server_socket_path);
 	}
 
+	/* A successor that took over our state doesn't need the file */
+	if (state_file_path != NULL && !handed_off)
+		save_state_to_file(state_file_path, &cntr);
+
 	g_main_loop_unref(loop);
 
-	return 0;
+	return exit_status;
 }
+#endif
@@ -1,5 +1,11 @@
 # SPDX-License-Identifier: Apache-2.0
 
+# Profile guided optimization, trained on handoffs and command traffic. This
+# runs the service in the build root, so it's only done with --with pgo.
+%bcond_with pgo
+# A stripped copy of the binary for the dracut module to install
+%bcond_without initrd_stripped
+
 Name:		early-service
 Version:	0.1
 Release:	1%{?dist}
@@ -10,6 +16,8 @@ Requires:	systemd
 BuildRequires:	meson
 BuildRequires:	gcc
 BuildRequires:	glibc-devel
+BuildRequires:	glib2-devel >= 2.68
+BuildRequires:	python3
 BuildRequires:  systemd-rpm-macros
 %{?systemd_requires}
 %{?sysusers_requires_compat}
@@ -24,7 +32,14 @@ to a new process started from the root filesystem.
 %autosetup -n %{name}-%{version}
 
 %build
-%meson
+%if %{with pgo}
+%meson -Db_pgo=generate -Dinitrd_stripped=%{?with_initrd_stripped:true}%{!?with_initrd_stripped:false}
+%meson_build
+python3 scripts/workload.py train %{_vpath_builddir}/early-service
+meson configure %{_vpath_builddir} -Db_pgo=use
+%else
+%meson -Dinitrd_stripped=%{?with_initrd_stripped:true}%{!?with_initrd_stripped:false}
+%endif
 %meson_build
 
 %install
@@ -56,6 +71,10 @@ install -m644 conf/%{name}.sysusers %{buildroot}%{_sysusersdir}/%{name}.conf
 %files
 %license LICENSE.txt
 %{_bindir}/%{name}
+%if %{with initrd_stripped}
+%dir %{_libexecdir}/%{name}
+%{_libexecdir}/%{name}/%{name}-initrd
+%endif
 %{_unitdir}/%{name}.service
 %{_unitdir}/%{name}-initrd.service
 %{_sysusersdir}/%{name}.conf
@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+
+# Builds the binary with each of the build profiles, and reports the stripped
+# size and the time from exec until the server socket accepts connections,
+# along with the difference to the default profile, as a markdown table.
+# Extra arguments are passed to every `meson setup`.
+
+set -e
+
+BUILD_ROOT=_profiles
+SCRIPTS=$(dirname "$0")
+
+setup() {
+	local dir="${BUILD_ROOT}/$1"
+	shift
+
+	rm -rf "${dir}"
+	meson setup "${dir}" "$@" "${EXTRA_ARGS[@]}" > /dev/null
+	meson compile -C "${dir}" > /dev/null
+}
+
+pgo() {
+	local dir="${BUILD_ROOT}/$1"
+	shift
+
+	setup "$(basename "${dir}")" -Db_pgo=generate "$@"
+	"${SCRIPTS}/workload.py" train "${dir}/early-service"
+	meson configure "${dir}" -Db_pgo=use > /dev/null
+	meson compile -C "${dir}" > /dev/null
+}
+
+# Prints the difference of $1 to $2 in percent
+delta() {
+	awk -v value="$1" -v base="$2" \
+		'BEGIN { printf "%+.1f%%", base ? (value - base) * 100 / base : 0 }'
+}
+
+report() {
+	local binary="${BUILD_ROOT}/$1/early-service"
+	local size startup
+
+	strip -o "${binary}.stripped" "${binary}"
+	size=$(stat -c %s "${binary}.stripped")
+	startup=$("${SCRIPTS}/workload.py" startup "${binary}")
+
+	if [ "$1" = default ] ; then
+		BASE_SIZE=${size}
+		BASE_STARTUP=${startup}
+	fi
+
+	printf "| %-10s | %12s | %8s | %12s | %8s |\n" "$1" \
+		"${size}" "$(delta "${size}" "${BASE_SIZE}")" \
+		"${startup}" "$(delta "${startup}" "${BASE_STARTUP}")"
+}
+
+EXTRA_ARGS=("$@")
+
+setup default -Doptimization=2
+setup size -Doptimization=s -Db_lto=true
+setup static-pie -Doptimization=s -Db_lto=true -Dstatic=static-pie
+pgo pgo -Doptimization=2 -Db_lto=true
+
+printf "| %-10s | %12s | %8s | %12s | %8s |\n" "profile" "size (bytes)" \
+	"size" "startup (us)" "startup"
+printf "|%s|%s|%s|%s|%s|\n" "------------" "--------------" "----------" \
+	"--------------" "----------"
+for profile in default size static-pie pgo ; do
+	report "${profile}"
+done
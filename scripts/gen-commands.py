@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+"""Generates the command dispatch table from commands.txt.
+
+The commands are dispatched with a switch on the length of the command name
+followed by a switch on its first byte, so that the cost of dispatching a
+command doesn't depend on how many commands there are.
+"""
+
+import sys
+
+ARG_TYPES = {
+    'int': ('int', 'command_parse_int'),
+    'int64': ('gint64', 'command_parse_int64'),
+    'rest': ('char *', 'command_parse_rest'),
+}
+
+
+def parse_spec(path):
+    commands = []
+    with open(path, encoding='utf-8') as spec:
+        for lineno, line in enumerate(spec, 1):
+            line = line.split('#', 1)[0].split()
+            if not line:
+                continue
+            name, args = line[0], line[1:]
+            for arg in args:
+                if arg not in ARG_TYPES:
+                    sys.exit(f'{path}:{lineno}: unknown argument type {arg}')
+            if 'rest' in args[:-1]:
+                sys.exit(f'{path}:{lineno}: rest has to be the last argument')
+            if any(name == command[0] for command in commands):
+                sys.exit(f'{path}:{lineno}: duplicate command {name}')
+            commands.append((name, args))
+    return commands
+
+
+def c_char(char):
+    return "'\\''" if char == "'" else f"'{char}'"
+
+
+def generate_command(out, name, args, indent):
+    out.append(f'{indent}if (memcmp(command, "{name}", {len(name)}) == 0) {{')
+    for i, arg in enumerate(args):
+        ctype = ARG_TYPES[arg][0]
+        out.append(f'{indent}\t{ctype}{"" if ctype.endswith("*") else " "}arg{i};')
+    if args:
+        out.append('')
+
+    checks = [f'!{ARG_TYPES[arg][1]}(&args, &arg{i})' for i, arg in enumerate(args)]
+    checks.append('!command_parse_end(&args)')
+    out.append(f'{indent}\tconn->command = "{name}";')
+    out.append(f'{indent}\tif ({" ||".join(checks[:1])}' +
+               ''.join(f' ||\n{indent}\t    {check}' for check in checks[1:]) + ')')
+    out.append(f'{indent}\t\treturn server_command_invalid(conn);')
+    out.append('')
+    call_args = ''.join(f', arg{i}' for i in range(len(args)))
+    out.append(f'{indent}\treturn server_command_{name}(conn{call_args});')
+    out.append(f'{indent}}}')
+
+
+def generate(commands):
+    out = ['// SPDX-License-Identifier: Apache-2.0',
+           '// Generated by scripts/gen-commands.py from commands.txt. Do not edit.',
+           '']
+
+    for name, args in commands:
+        params = ''.join(f', {ARG_TYPES[arg][0]}{"" if ARG_TYPES[arg][0].endswith("*") else " "}arg{i}'
+                         for i, arg in enumerate(args))
+        out.append(f'static gboolean server_command_{name}(struct connection_info *conn{params});')
+
+    out += ['',
+            'static gboolean server_dispatch_command(struct connection_info *conn,',
+            '\t\t\t\t\tchar *command)',
+            '{',
+            '\tchar *args = strchr(command, \' \');',
+            '\tgsize len = args != NULL ? (gsize) (args - command) : strlen(command);',
+            '',
+            '\tif (args == NULL)',
+            '\t\targs = command + len;',
+            '',
+            '\tswitch (len) {']
+
+    by_length = {}
+    for name, args in commands:
+        by_length.setdefault(len(name), {}).setdefault(name[0], []).append((name, args))
+
+    for length in sorted(by_length):
+        out.append(f'\tcase {length}:')
+        out.append('\t\tswitch (command[0]) {')
+        for first in sorted(by_length[length]):
+            out.append(f'\t\tcase {c_char(first)}:')
+            for name, args in by_length[length][first]:
+                generate_command(out, name, args, '\t\t\t')
+            out.append('\t\t\tbreak;')
+        out.append('\t\t}')
+        out.append('\t\tbreak;')
+
+    out += ['\t}',
+            '',
+            '\treturn server_command_unknown(conn, command);',
+            '}',
+            '']
+
+    return '\n'.join(out)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(f'usage: {sys.argv[0]} <commands.txt> <commands.h>')
+
+    output = generate(parse_spec(sys.argv[1]))
+    with open(sys.argv[2], 'w', encoding='utf-8') as header:
+        header.write(output)
+
+
+if __name__ == '__main__':
+    main()
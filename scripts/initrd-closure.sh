@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+
+# Reports the files that dracut's inst_binary pulls into the initrd for a
+# binary, which is the binary itself plus the shared libraries that ldd
+# reports, along with their compressed size. Fails if the compressed size is
+# above the budget in bytes. A budget of 0 only reports the sizes. Libraries
+# that the initrd already contains for systemd, such as libc, are counted too,
+# so this is an upper bound.
+#
+# The compressor defaults to zstd, which is what dracut uses on Fedora and
+# CentOS, and can be changed by setting COMPRESS.
+
+set -e
+
+BINARY=$1
+BUDGET=${2:-0}
+if [ "${BINARY}" = "" ] ; then
+	echo "usage: $0 <binary> [budget in bytes]"
+	exit 1
+fi
+
+if [ "${COMPRESS}" = "" ] ; then
+	if command -v zstd > /dev/null ; then
+		COMPRESS="zstd -q -15 -c"
+	else
+		COMPRESS="gzip -9 -c"
+	fi
+fi
+
+# ldd already lists the whole dependency closure. The vdso has no file.
+FILES=("${BINARY}")
+while read -r FILE ; do
+	FILES+=("$(readlink -f "${FILE}")")
+done < <(ldd "${BINARY}" 2>/dev/null | grep -o '/[^ ]*' | sort -u)
+
+TOTAL=0
+COMPRESSED_TOTAL=0
+printf "%12s %12s  %s\n" "size" "compressed" "file"
+for FILE in "${FILES[@]}" ; do
+	SIZE=$(stat -L -c %s "${FILE}")
+	COMPRESSED=$(${COMPRESS} < "${FILE}" | wc -c)
+	TOTAL=$((TOTAL + SIZE))
+	COMPRESSED_TOTAL=$((COMPRESSED_TOTAL + COMPRESSED))
+	printf "%12d %12d  %s\n" "${SIZE}" "${COMPRESSED}" "${FILE}"
+done
+printf "%12d %12d  %s\n" "${TOTAL}" "${COMPRESSED_TOTAL}" "total"
+
+if [ "${BUDGET}" -gt 0 ] && [ "${COMPRESSED_TOTAL}" -gt "${BUDGET}" ] ; then
+	echo "Compressed size ${COMPRESSED_TOTAL} is over the budget of ${BUDGET} bytes" >&2
+	exit 1
+fi
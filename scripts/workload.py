@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+"""Runs early-service through a representative workload.
+
+train:   a chain of handoffs between generations with command traffic on
+         each one, used as the training run for profile guided optimization.
+startup: the time from exec until the server accepts connections.
+"""
+
+import argparse
+import os
+import signal
+import socket
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def send_command(path, data):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(path)
+        sock.sendall(data)
+        sock.shutdown(socket.SHUT_WR)
+        reply = b''
+        while chunk := sock.recv(4096):
+            reply += chunk
+    return reply
+
+
+def start(args, sock_path, timeout=5.0):
+    """Starts the service, and returns it once the socket accepts connections"""
+    begin = time.monotonic()
+    proc = subprocess.Popen(args, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    while True:
+        try:
+            with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+                sock.connect(sock_path)
+            return proc, time.monotonic() - begin
+        except (FileNotFoundError, ConnectionRefusedError):
+            if proc.poll() is not None:
+                sys.exit(f'{args[0]} exited with {proc.returncode}')
+            if time.monotonic() - begin > timeout:
+                proc.kill()
+                sys.exit(f'{args[0]} did not start listening on {sock_path}')
+
+
+def stop(proc):
+    proc.send_signal(signal.SIGTERM)
+    proc.wait(timeout=5)
+
+
+def train(args):
+    tmpdir = tempfile.mkdtemp()
+    prev_path = None
+    prev_proc = None
+
+    for gen in range(args.generations):
+        # Alternates between the initrd and root filesystem locations
+        sock_path = os.path.join(tmpdir, f'early-service-{gen % 2}.sock')
+        cmdline = [args.binary, '--timer_delay_ms', '1',
+                   '--server_socket_path', sock_path]
+        if prev_path is not None:
+            cmdline += ['--client_socket_path', prev_path]
+
+        proc, _ = start(cmdline, sock_path)
+        if prev_proc is not None:
+            prev_proc.wait(timeout=5)
+
+        for i in range(args.requests):
+            send_command(sock_path, b'get_counter\n')
+            send_command(sock_path, b'set_counter %d\n' % i)
+            send_command(sock_path,
+                         b'get_counter\nset_counter 5\nget_counter')
+            send_command(sock_path, b'batch get; add 1; cas 2 3; set 0\n')
+            send_command(sock_path, b'unknown\n')
+        send_command(sock_path, b'x' * 300 + b'\nget_counter\n')
+
+        prev_path = sock_path
+        prev_proc = proc
+
+    stop(prev_proc)
+
+
+def startup(args):
+    tmpdir = tempfile.mkdtemp()
+    sock_path = os.path.join(tmpdir, 'early-service.sock')
+    times = []
+
+    for _ in range(args.runs):
+        proc, elapsed = start([args.binary, '--server_socket_path', sock_path],
+                              sock_path)
+        times.append(elapsed)
+        stop(proc)
+
+    print(f'{statistics.median(times) * 1e6:.0f}')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    subparsers = parser.add_subparsers(dest='mode', required=True)
+
+    parser_train = subparsers.add_parser('train')
+    parser_train.add_argument('binary')
+    parser_train.add_argument('--generations', type=int, default=10)
+    parser_train.add_argument('--requests', type=int, default=200)
+    parser_train.set_defaults(func=train)
+
+    parser_startup = subparsers.add_parser('startup',
+                                           help='prints the median in microseconds')
+    parser_startup.add_argument('binary')
+    parser_startup.add_argument('--runs', type=int, default=20)
+    parser_startup.set_defaults(func=startup)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,440 @@
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Tests for reading the state across versions, from the file descriptor store
+ * and from the handoff between generations.
+ * This file is included at the end of early-service.c when it's built as
+ * early-service-state-layout-test, so that it can call the static functions
+ * directly, and it has its own main() in place of the service's. `meson test`
+ * runs it.
+ *
+ * The states of other versions are built field by field, the way that those
+ * versions would lay them out, and then read with read_state_layout().
+ */
+
+/* Field ids that this version doesn't know about */
+#define TEST_FIELD_UNKNOWN 200
+
+struct test_field {
+	guint16 id;
+	guint16 flags;
+	guint32 size;
+	guint64 value;
+};
+
+/* The fields of version 1.0, in the order that it writes them */
+static const struct test_field test_fields_1_0[] = {
+	{ STATE_FIELD_COUNTER, 0, sizeof(gint32), 42 },
+	{ STATE_FIELD_GENERATION, 0, sizeof(guint32), 7 },
+	{ STATE_FIELD_BASE, 0, sizeof(gint32), 42 },
+	{ STATE_FIELD_EPOCH_US, 0, sizeof(gint64), 0 },
+	{ STATE_FIELD_PERIOD_US, 0, sizeof(gint64), 0 },
+	{ STATE_FIELD_VIRTUAL_NOW_US, 0, sizeof(gint64), 0 },
+};
+
+/*
+ * Lays out the header, the field table and the fields, each aligned to its
+ * size, in a slot. Returns the size of the state.
+ */
+static guint32 test_build_layout(char *buf, guint16 major, guint16 minor,
+				 const struct test_field *fields,
+				 guint n_fields)
+{
+	struct state_layout_header *header = (void *) buf;
+	struct state_field *table = (void *) (header + 1);
+	gsize offset = sizeof(*header) + n_fields * sizeof(*table);
+
+	memset(buf, 0, STATE_SLOT_SIZE);
+	memcpy(header->magic, STATE_LAYOUT_MAGIC, sizeof(STATE_LAYOUT_MAGIC));
+	header->major = major;
+	header->minor = minor;
+	header->n_fields = n_fields;
+	header->sequence = 1;
+
+	for (guint i = 0; i < n_fields; i++) {
+		guint32 value32 = fields[i].value;
+
+		offset = (offset + fields[i].size - 1) / fields[i].size *
+			 fields[i].size;
+		g_assert_cmpuint(offset + fields[i].size, <=, STATE_SLOT_SIZE);
+
+		table[i] = (struct state_field) {
+			.id = fields[i].id,
+			.flags = fields[i].flags,
+			.offset = offset,
+			.size = fields[i].size,
+		};
+		if (fields[i].size == sizeof(value32))
+			memcpy(buf + offset, &value32, sizeof(value32));
+		else
+			memcpy(buf + offset, &fields[i].value, sizeof(fields[i].value));
+		offset += fields[i].size;
+	}
+
+	header->size = offset;
+	header->crc = state_layout_crc(buf, header->size);
+
+	return header->size;
+}
+
+static void test_counter_init(struct counter_data *cntr)
+{
+	memset(cntr, 0, sizeof(*cntr));
+	history_init(&cntr->history, 0);
+}
+
+static void test_read_1_0(void)
+{
+	char buf[STATE_SLOT_SIZE];
+	struct counter_data cntr;
+
+	test_counter_init(&cntr);
+	test_build_layout(buf, 1, 0, test_fields_1_0,
+			  G_N_ELEMENTS(test_fields_1_0));
+
+	g_assert_true(read_state_layout(buf, sizeof(buf), &cntr));
+	g_assert_cmpint(cntr.counter, ==, 42);
+	g_assert_cmpuint(cntr.generation, ==, 7);
+}
+
+/* A later minor version can move the fields and add ones we don't know */
+static void test_read_newer_minor(void)
+{
+	static const struct test_field fields[] = {
+		{ TEST_FIELD_UNKNOWN, 0, sizeof(guint64), 1234 },
+		{ STATE_FIELD_GENERATION, 0, sizeof(guint32), 8 },
+		{ STATE_FIELD_COUNTER, 0, sizeof(gint32), 99 },
+		{ TEST_FIELD_UNKNOWN + 1, 0, sizeof(guint32), 5678 },
+		{ STATE_FIELD_BASE, 0, sizeof(gint32), 99 },
+	};
+	char buf[STATE_SLOT_SIZE];
+	struct counter_data cntr;
+
+	test_counter_init(&cntr);
+	test_build_layout(buf, STATE_LAYOUT_MAJOR, STATE_LAYOUT_MINOR + 3,
+			  fields, G_N_ELEMENTS(fields));
+
+	g_assert_true(read_state_layout(buf, sizeof(buf), &cntr));
+	g_assert_cmpint(cntr.counter, ==, 99);
+	g_assert_cmpuint(cntr.generation, ==, 8);
+}
+
+static void test_reject_unknown_required(void)
+{
+	static const struct test_field fields[] = {
+		{ STATE_FIELD_COUNTER, 0, sizeof(gint32), 99 },
+		{ TEST_FIELD_UNKNOWN, STATE_FIELD_REQUIRED, sizeof(guint64), 1 },
+	};
+	char buf[STATE_SLOT_SIZE];
+	struct counter_data cntr;
+
+	test_counter_init(&cntr);
+	test_build_layout(buf, STATE_LAYOUT_MAJOR, STATE_LAYOUT_MINOR + 1,
+			  fields, G_N_ELEMENTS(fields));
+
+	g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "*unknown field 200*");
+	g_assert_false(read_state_layout(buf, sizeof(buf), &cntr));
+	g_test_assert_expected_messages();
+}
+
+static void test_reject_other_major(void)
+{
+	char buf[STATE_SLOT_SIZE];
+	struct counter_data cntr;
+
+	test_counter_init(&cntr);
+	test_build_layout(buf, STATE_LAYOUT_MAJOR + 1, 0, test_fields_1_0,
+			  G_N_ELEMENTS(test_fields_1_0));
+
+	g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "Can't read version 2.0*");
+	g_assert_false(read_state_layout(buf, sizeof(buf), &cntr));
+	g_test_assert_expected_messages();
+}
+
+static void test_reject_short(void)
+{
+	char buf[STATE_SLOT_SIZE];
+	struct counter_data cntr;
+
+	test_counter_init(&cntr);
+	test_build_layout(buf, 1, 0, test_fields_1_0,
+			  G_N_ELEMENTS(test_fields_1_0));
+
+	g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "*too short*");
+	g_assert_false(read_state_layout(buf, sizeof(struct state_layout_header) - 1,
+					 &cntr));
+	g_test_assert_expected_messages();
+}
+
+static void test_reject_bad_crc(void)
+{
+	char buf[STATE_SLOT_SIZE];
+	struct counter_data cntr;
+	guint32 size;
+
+	test_counter_init(&cntr);
+	size = test_build_layout(buf, 1, 0, test_fields_1_0,
+				 G_N_ELEMENTS(test_fields_1_0));
+	buf[size - 1] ^= 1;
+
+	state_corrupted = FALSE;
+	g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "*doesn't match its CRC32C*");
+	g_assert_false(read_state_layout(buf, sizeof(buf), &cntr));
+	g_test_assert_expected_messages();
+	g_assert_true(state_corrupted);
+}
+
+static void test_reject_out_of_bounds(void)
+{
+	struct state_layout_header *header;
+	struct state_field *table;
+	char buf[STATE_SLOT_SIZE];
+	struct counter_data cntr;
+
+	test_counter_init(&cntr);
+	test_build_layout(buf, 1, 0, test_fields_1_0,
+			  G_N_ELEMENTS(test_fields_1_0));
+	header = (void *) buf;
+	table = (void *) (header + 1);
+	table[1].offset = header->size;
+	header->crc = state_layout_crc(buf, header->size);
+
+	g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "*field 2 is out of bounds*");
+	g_assert_false(read_state_layout(buf, sizeof(buf), &cntr));
+	g_test_assert_expected_messages();
+}
+
+/* Sets up the store like systemd would pass it back to us */
+static void test_store_open(void)
+{
+	state_fd = memfd_create("early-service-state-test", MFD_CLOEXEC);
+	g_assert_cmpint(state_fd, >=, 0);
+}
+
+static gboolean test_store_read(struct counter_data *cntr)
+{
+	if (state_store != NULL)
+		munmap(state_store, state_store_size);
+	state_store = NULL;
+
+	test_counter_init(cntr);
+	return read_state_from_fd_store(cntr);
+}
+
+static void test_store_close(void)
+{
+	munmap(state_store, state_store_size);
+	state_store = NULL;
+	close(state_fd);
+	state_fd = -1;
+}
+
+/* The memfd of a version from before the binary layout */
+static void test_read_legacy_text(void)
+{
+	GString *state = g_string_new("17\ngeneration 4\n");
+	struct counter_data cntr;
+
+	append_state_checksum(state, 0);
+	g_assert_cmpuint(state->len, <=, STATE_TEXT_SIZE);
+
+	test_store_open();
+	g_assert_cmpint(ftruncate(state_fd, STATE_TEXT_SIZE), ==, 0);
+	g_assert_cmpint(pwrite(state_fd, state->str, state->len, 0), ==,
+			state->len);
+	g_string_free(state, TRUE);
+
+	g_assert_true(test_store_read(&cntr));
+	g_assert_cmpint(cntr.counter, ==, 17);
+	g_assert_cmpuint(cntr.generation, ==, 4);
+
+	test_store_close();
+}
+
+/* A crash while writing one slot leaves the state from the other one */
+static void test_read_previous_slot(void)
+{
+	struct counter_data cntr;
+
+	test_store_open();
+	g_assert_true(map_state_store());
+	create_state_store();
+
+	test_counter_init(&cntr);
+	cntr.counter = 5;
+	store_state(&cntr);
+	cntr.counter = 6;
+	store_state(&cntr);
+
+	g_assert_true(test_store_read(&cntr));
+	g_assert_cmpint(cntr.counter, ==, 6);
+
+	state_slot(state_store_slot)->counter = 7;
+
+	g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "*doesn't match its CRC32C*");
+	g_assert_true(test_store_read(&cntr));
+	g_test_assert_expected_messages();
+	g_assert_cmpint(cntr.counter, ==, 5);
+
+	test_store_close();
+}
+
+/*
+ * The text state of a version with the given layout, which sends it after the
+ * key lines that older versions know.
+ */
+static GString *test_handoff_state(const char *lines, const char *layout,
+				   gsize len)
+{
+	GString *state = g_string_new(lines);
+	gchar *encoded;
+
+	if (layout != NULL) {
+		encoded = g_base64_encode((const guchar *) layout, len);
+		g_string_append_printf(state, STATE_LAYOUT_KEY "%s\n", encoded);
+		g_free(encoded);
+	}
+	append_state_checksum(state, 0);
+
+	return state;
+}
+
+/* The oldest predecessors only send the counter */
+static void test_handoff_bare_counter(void)
+{
+	struct counter_data cntr;
+
+	test_counter_init(&cntr);
+	g_assert_true(parse_state("17\n", &cntr));
+	g_assert_cmpint(cntr.counter, ==, 17);
+	g_assert_cmpuint(cntr.generation, ==, 0);
+}
+
+/* Predecessors from before the layout only send the key lines */
+static void test_handoff_without_layout(void)
+{
+	GString *state = test_handoff_state("17\ngeneration 4\nhistory 100 16\n",
+					    NULL, 0);
+	struct counter_data cntr;
+
+	test_counter_init(&cntr);
+	history_init(&cntr.history, 4);
+	g_assert_true(parse_state(state->str, &cntr));
+	g_assert_cmpint(cntr.counter, ==, 17);
+	g_assert_cmpuint(cntr.generation, ==, 4);
+	g_assert_cmpuint(cntr.history.count, ==, 1);
+
+	g_free(cntr.history.samples);
+	g_string_free(state, TRUE);
+}
+
+/*
+ * Our state still starts with the counter for successors that only read the
+ * first number, and has the key lines for those from before the layout.
+ */
+static void test_handoff_round_trip(void)
+{
+	struct counter_data cntr, successor;
+	GString *state = g_string_new(NULL);
+
+	test_counter_init(&cntr);
+	history_init(&cntr.history, 4);
+	cntr.counter = 23;
+	cntr.generation = 5;
+	history_add(&cntr.history, 100, 22);
+	format_state(&cntr, state);
+	append_state_checksum(state, 0);
+
+	g_assert_true(g_str_has_prefix(state->str, "23\n"));
+	g_assert_cmpint(g_ascii_strtoll(state->str, NULL, 10), ==, 23);
+	g_assert_nonnull(strstr(state->str, "\ngeneration 5\n"));
+	g_assert_nonnull(strstr(state->str, "\n" STATE_LAYOUT_KEY));
+
+	test_counter_init(&successor);
+	history_init(&successor.history, 4);
+	g_assert_true(parse_state(state->str, &successor));
+	g_assert_cmpint(successor.counter, ==, 23);
+	g_assert_cmpuint(successor.generation, ==, 5);
+	g_assert_cmpuint(successor.history.count, ==, 1);
+
+	g_free(cntr.history.samples);
+	g_free(successor.history.samples);
+	g_string_free(state, TRUE);
+}
+
+/* The layout wins over the key lines, and can be a later minor version */
+static void test_handoff_newer_minor(void)
+{
+	static const struct test_field fields[] = {
+		{ TEST_FIELD_UNKNOWN, 0, sizeof(guint64), 1234 },
+		{ STATE_FIELD_GENERATION, 0, sizeof(guint32), 8 },
+		{ STATE_FIELD_COUNTER, 0, sizeof(gint32), 99 },
+	};
+	char buf[STATE_SLOT_SIZE];
+	struct counter_data cntr;
+	GString *state;
+	guint32 size;
+
+	size = test_build_layout(buf, STATE_LAYOUT_MAJOR, STATE_LAYOUT_MINOR + 3,
+				 fields, G_N_ELEMENTS(fields));
+	state = test_handoff_state("98\ngeneration 7\n", buf, size);
+
+	test_counter_init(&cntr);
+	g_assert_true(parse_state(state->str, &cntr));
+	g_assert_cmpint(cntr.counter, ==, 99);
+	g_assert_cmpuint(cntr.generation, ==, 8);
+
+	g_string_free(state, TRUE);
+}
+
+/* A successor that can't read the layout falls back to the next source */
+static void test_handoff_other_major(void)
+{
+	char buf[STATE_SLOT_SIZE];
+	struct counter_data cntr;
+	GString *state;
+	guint32 size;
+
+	size = test_build_layout(buf, STATE_LAYOUT_MAJOR + 1, 0, test_fields_1_0,
+				 G_N_ELEMENTS(test_fields_1_0));
+	state = test_handoff_state("42\ngeneration 7\n", buf, size);
+
+	test_counter_init(&cntr);
+	g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "Can't read version 2.0*");
+	g_assert_false(parse_state(state->str, &cntr));
+	g_test_assert_expected_messages();
+
+	g_string_free(state, TRUE);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+	crc32c_init();
+
+	g_test_add_func("/state-layout/read-1.0", test_read_1_0);
+	g_test_add_func("/state-layout/read-newer-minor", test_read_newer_minor);
+	g_test_add_func("/state-layout/reject-unknown-required",
+			test_reject_unknown_required);
+	g_test_add_func("/state-layout/reject-other-major",
+			test_reject_other_major);
+	g_test_add_func("/state-layout/reject-short", test_reject_short);
+	g_test_add_func("/state-layout/reject-bad-crc", test_reject_bad_crc);
+	g_test_add_func("/state-layout/reject-out-of-bounds",
+			test_reject_out_of_bounds);
+	g_test_add_func("/state-layout/read-legacy-text", test_read_legacy_text);
+	g_test_add_func("/state-layout/read-previous-slot",
+			test_read_previous_slot);
+	g_test_add_func("/state-layout/handoff-bare-counter",
+			test_handoff_bare_counter);
+	g_test_add_func("/state-layout/handoff-without-layout",
+			test_handoff_without_layout);
+	g_test_add_func("/state-layout/handoff-round-trip",
+			test_handoff_round_trip);
+	g_test_add_func("/state-layout/handoff-newer-minor",
+			test_handoff_newer_minor);
+	g_test_add_func("/state-layout/handoff-other-major",
+			test_handoff_other_major);
+
+	return g_test_run();
+}